@@ -126,33 +126,100 @@ BEGIN_RCPP
 END_RCPP
 }
 // predict_cpp
-NumericVector predict_cpp(int n, const arma::vec& nsr, int reps, const arma::mat& V);
-RcppExport SEXP _phyr_predict_cpp(SEXP nSEXP, SEXP nsrSEXP, SEXP repsSEXP, SEXP VSEXP) {
+NumericVector predict_cpp(int n, const arma::vec& nsr, int reps, SEXP V, double tol, double seed, int nthreads, bool nested);
+RcppExport SEXP _phyr_predict_cpp(SEXP nSEXP, SEXP nsrSEXP, SEXP repsSEXP, SEXP VSEXP, SEXP tolSEXP, SEXP seedSEXP, SEXP nthreadsSEXP, SEXP nestedSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
     Rcpp::traits::input_parameter< int >::type n(nSEXP);
     Rcpp::traits::input_parameter< const arma::vec& >::type nsr(nsrSEXP);
     Rcpp::traits::input_parameter< int >::type reps(repsSEXP);
-    Rcpp::traits::input_parameter< const arma::mat& >::type V(VSEXP);
-    rcpp_result_gen = Rcpp::wrap(predict_cpp(n, nsr, reps, V));
+    Rcpp::traits::input_parameter< SEXP >::type V(VSEXP);
+    Rcpp::traits::input_parameter< double >::type tol(tolSEXP);
+    Rcpp::traits::input_parameter< double >::type seed(seedSEXP);
+    Rcpp::traits::input_parameter< int >::type nthreads(nthreadsSEXP);
+    Rcpp::traits::input_parameter< bool >::type nested(nestedSEXP);
+    rcpp_result_gen = Rcpp::wrap(predict_cpp(n, nsr, reps, V, tol, seed, nthreads, nested));
+    return rcpp_result_gen;
+END_RCPP
+}
+// predict_hash_cpp
+std::string predict_hash_cpp(SEXP V, const NumericVector& params);
+RcppExport SEXP _phyr_predict_hash_cpp(SEXP VSEXP, SEXP paramsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type V(VSEXP);
+    Rcpp::traits::input_parameter< const NumericVector& >::type params(paramsSEXP);
+    rcpp_result_gen = Rcpp::wrap(predict_hash_cpp(V, params));
     return rcpp_result_gen;
 END_RCPP
 }
 // pcd2_loop
-List pcd2_loop(arma::vec SSii, arma::vec nsr, double SCii, const arma::mat& comm, const arma::mat& V, int nsp_pool, bool verbose);
-RcppExport SEXP _phyr_pcd2_loop(SEXP SSiiSEXP, SEXP nsrSEXP, SEXP SCiiSEXP, SEXP commSEXP, SEXP VSEXP, SEXP nsp_poolSEXP, SEXP verboseSEXP) {
+List pcd2_loop(arma::vec SSii, arma::vec nsr, double SCii, SEXP comm, SEXP V, int nsp_pool, bool verbose, int nthreads, SEXP metrics, bool single, std::string file);
+RcppExport SEXP _phyr_pcd2_loop(SEXP SSiiSEXP, SEXP nsrSEXP, SEXP SCiiSEXP, SEXP commSEXP, SEXP VSEXP, SEXP nsp_poolSEXP, SEXP verboseSEXP, SEXP nthreadsSEXP, SEXP metricsSEXP, SEXP singleSEXP, SEXP fileSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
     Rcpp::traits::input_parameter< arma::vec >::type SSii(SSiiSEXP);
     Rcpp::traits::input_parameter< arma::vec >::type nsr(nsrSEXP);
     Rcpp::traits::input_parameter< double >::type SCii(SCiiSEXP);
-    Rcpp::traits::input_parameter< const arma::mat& >::type comm(commSEXP);
-    Rcpp::traits::input_parameter< const arma::mat& >::type V(VSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type comm(commSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type V(VSEXP);
     Rcpp::traits::input_parameter< int >::type nsp_pool(nsp_poolSEXP);
     Rcpp::traits::input_parameter< bool >::type verbose(verboseSEXP);
-    rcpp_result_gen = Rcpp::wrap(pcd2_loop(SSii, nsr, SCii, comm, V, nsp_pool, verbose));
+    Rcpp::traits::input_parameter< int >::type nthreads(nthreadsSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type metrics(metricsSEXP);
+    Rcpp::traits::input_parameter< bool >::type single(singleSEXP);
+    Rcpp::traits::input_parameter< std::string >::type file(fileSEXP);
+    rcpp_result_gen = Rcpp::wrap(pcd2_loop(SSii, nsr, SCii, comm, V, nsp_pool, verbose, nthreads, metrics, single, file));
+    return rcpp_result_gen;
+END_RCPP
+}
+// pcd2_cross
+List pcd2_cross(arma::vec SSii, arma::vec nsr, double SCii, SEXP comm, SEXP comm_2, const IntegerVector& cols, const IntegerVector& cols_2, SEXP V, int nsp_pool, bool verbose, int nthreads, SEXP metrics, bool paired);
+RcppExport SEXP _phyr_pcd2_cross(SEXP SSiiSEXP, SEXP nsrSEXP, SEXP SCiiSEXP, SEXP commSEXP, SEXP comm_2SEXP, SEXP colsSEXP, SEXP cols_2SEXP, SEXP VSEXP, SEXP nsp_poolSEXP, SEXP verboseSEXP, SEXP nthreadsSEXP, SEXP metricsSEXP, SEXP pairedSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< arma::vec >::type SSii(SSiiSEXP);
+    Rcpp::traits::input_parameter< arma::vec >::type nsr(nsrSEXP);
+    Rcpp::traits::input_parameter< double >::type SCii(SCiiSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type comm(commSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type comm_2(comm_2SEXP);
+    Rcpp::traits::input_parameter< const IntegerVector& >::type cols(colsSEXP);
+    Rcpp::traits::input_parameter< const IntegerVector& >::type cols_2(cols_2SEXP);
+    Rcpp::traits::input_parameter< SEXP >::type V(VSEXP);
+    Rcpp::traits::input_parameter< int >::type nsp_pool(nsp_poolSEXP);
+    Rcpp::traits::input_parameter< bool >::type verbose(verboseSEXP);
+    Rcpp::traits::input_parameter< int >::type nthreads(nthreadsSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type metrics(metricsSEXP);
+    Rcpp::traits::input_parameter< bool >::type paired(pairedSEXP);
+    rcpp_result_gen = Rcpp::wrap(pcd2_cross(SSii, nsr, SCii, comm, comm_2, cols, cols_2, V, nsp_pool, verbose, nthreads, metrics, paired));
+    return rcpp_result_gen;
+END_RCPP
+}
+// pcd_read_cpp
+List pcd_read_cpp(const std::string& path, const LogicalVector& metrics, SEXP sites);
+RcppExport SEXP _phyr_pcd_read_cpp(SEXP pathSEXP, SEXP metricsSEXP, SEXP sitesSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const std::string& >::type path(pathSEXP);
+    Rcpp::traits::input_parameter< const LogicalVector& >::type metrics(metricsSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type sites(sitesSEXP);
+    rcpp_result_gen = Rcpp::wrap(pcd_read_cpp(path, metrics, sites));
+    return rcpp_result_gen;
+END_RCPP
+}
+// float_unpack_cpp
+NumericVector float_unpack_cpp(const RawVector& x);
+RcppExport SEXP _phyr_float_unpack_cpp(SEXP xSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const RawVector& >::type x(xSEXP);
+    rcpp_result_gen = Rcpp::wrap(float_unpack_cpp(x));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -336,20 +403,68 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
-// vcv_loop
-arma::mat vcv_loop(NumericVector& xx, const int& n, const IntegerVector& e1, const IntegerVector& e2, const NumericVector& EL, const List& pp, bool corr);
-RcppExport SEXP _phyr_vcv_loop(SEXP xxSEXP, SEXP nSEXP, SEXP e1SEXP, SEXP e2SEXP, SEXP ELSEXP, SEXP ppSEXP, SEXP corrSEXP) {
+// vcv_tree_cpp
+arma::mat vcv_tree_cpp(const IntegerVector& e1, const IntegerVector& e2, const NumericVector& EL, const int& ntip, const bool corr);
+RcppExport SEXP _phyr_vcv_tree_cpp(SEXP e1SEXP, SEXP e2SEXP, SEXP ELSEXP, SEXP ntipSEXP, SEXP corrSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
-    Rcpp::traits::input_parameter< NumericVector& >::type xx(xxSEXP);
-    Rcpp::traits::input_parameter< const int& >::type n(nSEXP);
     Rcpp::traits::input_parameter< const IntegerVector& >::type e1(e1SEXP);
     Rcpp::traits::input_parameter< const IntegerVector& >::type e2(e2SEXP);
     Rcpp::traits::input_parameter< const NumericVector& >::type EL(ELSEXP);
-    Rcpp::traits::input_parameter< const List& >::type pp(ppSEXP);
-    Rcpp::traits::input_parameter< bool >::type corr(corrSEXP);
-    rcpp_result_gen = Rcpp::wrap(vcv_loop(xx, n, e1, e2, EL, pp, corr));
+    Rcpp::traits::input_parameter< const int& >::type ntip(ntipSEXP);
+    Rcpp::traits::input_parameter< const bool >::type corr(corrSEXP);
+    rcpp_result_gen = Rcpp::wrap(vcv_tree_cpp(e1, e2, EL, ntip, corr));
+    return rcpp_result_gen;
+END_RCPP
+}
+// vcv_tree_packed_cpp
+SEXP vcv_tree_packed_cpp(const IntegerVector& e1, const IntegerVector& e2, const NumericVector& EL, const int& ntip, const bool corr, const bool single);
+RcppExport SEXP _phyr_vcv_tree_packed_cpp(SEXP e1SEXP, SEXP e2SEXP, SEXP ELSEXP, SEXP ntipSEXP, SEXP corrSEXP, SEXP singleSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const IntegerVector& >::type e1(e1SEXP);
+    Rcpp::traits::input_parameter< const IntegerVector& >::type e2(e2SEXP);
+    Rcpp::traits::input_parameter< const NumericVector& >::type EL(ELSEXP);
+    Rcpp::traits::input_parameter< const int& >::type ntip(ntipSEXP);
+    Rcpp::traits::input_parameter< const bool >::type corr(corrSEXP);
+    Rcpp::traits::input_parameter< const bool >::type single(singleSEXP);
+    rcpp_result_gen = Rcpp::wrap(vcv_tree_packed_cpp(e1, e2, EL, ntip, corr, single));
+    return rcpp_result_gen;
+END_RCPP
+}
+// packed_subset_cpp
+SEXP packed_subset_cpp(SEXP Cmatrix, const IntegerVector& idx);
+RcppExport SEXP _phyr_packed_subset_cpp(SEXP CmatrixSEXP, SEXP idxSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type Cmatrix(CmatrixSEXP);
+    Rcpp::traits::input_parameter< const IntegerVector& >::type idx(idxSEXP);
+    rcpp_result_gen = Rcpp::wrap(packed_subset_cpp(Cmatrix, idx));
+    return rcpp_result_gen;
+END_RCPP
+}
+// packed_unpack_cpp
+NumericMatrix packed_unpack_cpp(SEXP Cmatrix);
+RcppExport SEXP _phyr_packed_unpack_cpp(SEXP CmatrixSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type Cmatrix(CmatrixSEXP);
+    rcpp_result_gen = Rcpp::wrap(packed_unpack_cpp(Cmatrix));
+    return rcpp_result_gen;
+END_RCPP
+}
+// vcv_sums_cpp
+NumericVector vcv_sums_cpp(SEXP Cmatrix);
+RcppExport SEXP _phyr_vcv_sums_cpp(SEXP CmatrixSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type Cmatrix(CmatrixSEXP);
+    rcpp_result_gen = Rcpp::wrap(vcv_sums_cpp(Cmatrix));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -364,27 +479,288 @@ BEGIN_RCPP
 END_RCPP
 }
 // pse_cpp
-NumericVector pse_cpp(const NumericMatrix& comm, const arma::mat& Cmatrix);
-RcppExport SEXP _phyr_pse_cpp(SEXP commSEXP, SEXP CmatrixSEXP) {
+NumericVector pse_cpp(SEXP comm, SEXP Cmatrix, const int nthreads);
+RcppExport SEXP _phyr_pse_cpp(SEXP commSEXP, SEXP CmatrixSEXP, SEXP nthreadsSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
-    Rcpp::traits::input_parameter< const NumericMatrix& >::type comm(commSEXP);
-    Rcpp::traits::input_parameter< const arma::mat& >::type Cmatrix(CmatrixSEXP);
-    rcpp_result_gen = Rcpp::wrap(pse_cpp(comm, Cmatrix));
+    Rcpp::traits::input_parameter< SEXP >::type comm(commSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type Cmatrix(CmatrixSEXP);
+    Rcpp::traits::input_parameter< const int >::type nthreads(nthreadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(pse_cpp(comm, Cmatrix, nthreads));
     return rcpp_result_gen;
 END_RCPP
 }
 // psv_cpp
-DataFrame psv_cpp(const NumericMatrix& comm, const arma::mat& Cmatrix, const bool compute_var);
-RcppExport SEXP _phyr_psv_cpp(SEXP commSEXP, SEXP CmatrixSEXP, SEXP compute_varSEXP) {
+DataFrame psv_cpp(SEXP comm, SEXP Cmatrix, const bool compute_var, const int nthreads);
+RcppExport SEXP _phyr_psv_cpp(SEXP commSEXP, SEXP CmatrixSEXP, SEXP compute_varSEXP, SEXP nthreadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type comm(commSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type Cmatrix(CmatrixSEXP);
+    Rcpp::traits::input_parameter< const bool >::type compute_var(compute_varSEXP);
+    Rcpp::traits::input_parameter< const int >::type nthreads(nthreadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(psv_cpp(comm, Cmatrix, compute_var, nthreads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// psv_spp_cpp
+List psv_spp_cpp(SEXP comm, SEXP Cmatrix, const int nthreads);
+RcppExport SEXP _phyr_psv_spp_cpp(SEXP commSEXP, SEXP CmatrixSEXP, SEXP nthreadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type comm(commSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type Cmatrix(CmatrixSEXP);
+    Rcpp::traits::input_parameter< const int >::type nthreads(nthreadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(psv_spp_cpp(comm, Cmatrix, nthreads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// psv_batch_cpp
+DataFrame psv_batch_cpp(SEXP comm, const arma::mat& Cmatrix, const bool compute_var, const int block);
+RcppExport SEXP _phyr_psv_batch_cpp(SEXP commSEXP, SEXP CmatrixSEXP, SEXP compute_varSEXP, SEXP blockSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
-    Rcpp::traits::input_parameter< const NumericMatrix& >::type comm(commSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type comm(commSEXP);
     Rcpp::traits::input_parameter< const arma::mat& >::type Cmatrix(CmatrixSEXP);
     Rcpp::traits::input_parameter< const bool >::type compute_var(compute_varSEXP);
-    rcpp_result_gen = Rcpp::wrap(psv_cpp(comm, Cmatrix, compute_var));
+    Rcpp::traits::input_parameter< const int >::type block(blockSEXP);
+    rcpp_result_gen = Rcpp::wrap(psv_batch_cpp(comm, Cmatrix, compute_var, block));
+    return rcpp_result_gen;
+END_RCPP
+}
+// pse_batch_cpp
+NumericVector pse_batch_cpp(SEXP comm, const arma::mat& Cmatrix, const int block);
+RcppExport SEXP _phyr_pse_batch_cpp(SEXP commSEXP, SEXP CmatrixSEXP, SEXP blockSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type comm(commSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type Cmatrix(CmatrixSEXP);
+    Rcpp::traits::input_parameter< const int >::type block(blockSEXP);
+    rcpp_result_gen = Rcpp::wrap(pse_batch_cpp(comm, Cmatrix, block));
+    return rcpp_result_gen;
+END_RCPP
+}
+// psv_tree_cpp
+DataFrame psv_tree_cpp(SEXP comm, const IntegerVector& tips, const IntegerVector& e1, const IntegerVector& e2, const NumericVector& EL, const int& ntip, const bool corr, const bool compute_var, const int nthreads);
+RcppExport SEXP _phyr_psv_tree_cpp(SEXP commSEXP, SEXP tipsSEXP, SEXP e1SEXP, SEXP e2SEXP, SEXP ELSEXP, SEXP ntipSEXP, SEXP corrSEXP, SEXP compute_varSEXP, SEXP nthreadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type comm(commSEXP);
+    Rcpp::traits::input_parameter< const IntegerVector& >::type tips(tipsSEXP);
+    Rcpp::traits::input_parameter< const IntegerVector& >::type e1(e1SEXP);
+    Rcpp::traits::input_parameter< const IntegerVector& >::type e2(e2SEXP);
+    Rcpp::traits::input_parameter< const NumericVector& >::type EL(ELSEXP);
+    Rcpp::traits::input_parameter< const int& >::type ntip(ntipSEXP);
+    Rcpp::traits::input_parameter< const bool >::type corr(corrSEXP);
+    Rcpp::traits::input_parameter< const bool >::type compute_var(compute_varSEXP);
+    Rcpp::traits::input_parameter< const int >::type nthreads(nthreadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(psv_tree_cpp(comm, tips, e1, e2, EL, ntip, corr, compute_var, nthreads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// pse_tree_cpp
+NumericVector pse_tree_cpp(SEXP comm, const IntegerVector& tips, const IntegerVector& e1, const IntegerVector& e2, const NumericVector& EL, const int& ntip, const bool corr, const int nthreads);
+RcppExport SEXP _phyr_pse_tree_cpp(SEXP commSEXP, SEXP tipsSEXP, SEXP e1SEXP, SEXP e2SEXP, SEXP ELSEXP, SEXP ntipSEXP, SEXP corrSEXP, SEXP nthreadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type comm(commSEXP);
+    Rcpp::traits::input_parameter< const IntegerVector& >::type tips(tipsSEXP);
+    Rcpp::traits::input_parameter< const IntegerVector& >::type e1(e1SEXP);
+    Rcpp::traits::input_parameter< const IntegerVector& >::type e2(e2SEXP);
+    Rcpp::traits::input_parameter< const NumericVector& >::type EL(ELSEXP);
+    Rcpp::traits::input_parameter< const int& >::type ntip(ntipSEXP);
+    Rcpp::traits::input_parameter< const bool >::type corr(corrSEXP);
+    Rcpp::traits::input_parameter< const int >::type nthreads(nthreadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(pse_tree_cpp(comm, tips, e1, e2, EL, ntip, corr, nthreads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// psc_tree_cpp
+NumericVector psc_tree_cpp(SEXP comm, const IntegerVector& tips, const IntegerVector& e1, const IntegerVector& e2, const NumericVector& EL, const int& ntip, const bool corr, const int nthreads);
+RcppExport SEXP _phyr_psc_tree_cpp(SEXP commSEXP, SEXP tipsSEXP, SEXP e1SEXP, SEXP e2SEXP, SEXP ELSEXP, SEXP ntipSEXP, SEXP corrSEXP, SEXP nthreadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type comm(commSEXP);
+    Rcpp::traits::input_parameter< const IntegerVector& >::type tips(tipsSEXP);
+    Rcpp::traits::input_parameter< const IntegerVector& >::type e1(e1SEXP);
+    Rcpp::traits::input_parameter< const IntegerVector& >::type e2(e2SEXP);
+    Rcpp::traits::input_parameter< const NumericVector& >::type EL(ELSEXP);
+    Rcpp::traits::input_parameter< const int& >::type ntip(ntipSEXP);
+    Rcpp::traits::input_parameter< const bool >::type corr(corrSEXP);
+    Rcpp::traits::input_parameter< const int >::type nthreads(nthreadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(psc_tree_cpp(comm, tips, e1, e2, EL, ntip, corr, nthreads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// psc_cpp
+NumericVector psc_cpp(SEXP comm, SEXP Cmatrix, const int nthreads);
+RcppExport SEXP _phyr_psc_cpp(SEXP commSEXP, SEXP CmatrixSEXP, SEXP nthreadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type comm(commSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type Cmatrix(CmatrixSEXP);
+    Rcpp::traits::input_parameter< const int >::type nthreads(nthreadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(psc_cpp(comm, Cmatrix, nthreads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// psd_cpp
+DataFrame psd_cpp(SEXP comm, SEXP Cmatrix, const bool compute_var, const int nthreads);
+RcppExport SEXP _phyr_psd_cpp(SEXP commSEXP, SEXP CmatrixSEXP, SEXP compute_varSEXP, SEXP nthreadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type comm(commSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type Cmatrix(CmatrixSEXP);
+    Rcpp::traits::input_parameter< const bool >::type compute_var(compute_varSEXP);
+    Rcpp::traits::input_parameter< const int >::type nthreads(nthreadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(psd_cpp(comm, Cmatrix, compute_var, nthreads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// psd_tree_cpp
+DataFrame psd_tree_cpp(SEXP comm, const IntegerVector& tips, const IntegerVector& e1, const IntegerVector& e2, const NumericVector& EL, const int& ntip, const bool corr, const bool compute_var, const int nthreads);
+RcppExport SEXP _phyr_psd_tree_cpp(SEXP commSEXP, SEXP tipsSEXP, SEXP e1SEXP, SEXP e2SEXP, SEXP ELSEXP, SEXP ntipSEXP, SEXP corrSEXP, SEXP compute_varSEXP, SEXP nthreadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type comm(commSEXP);
+    Rcpp::traits::input_parameter< const IntegerVector& >::type tips(tipsSEXP);
+    Rcpp::traits::input_parameter< const IntegerVector& >::type e1(e1SEXP);
+    Rcpp::traits::input_parameter< const IntegerVector& >::type e2(e2SEXP);
+    Rcpp::traits::input_parameter< const NumericVector& >::type EL(ELSEXP);
+    Rcpp::traits::input_parameter< const int& >::type ntip(ntipSEXP);
+    Rcpp::traits::input_parameter< const bool >::type corr(corrSEXP);
+    Rcpp::traits::input_parameter< const bool >::type compute_var(compute_varSEXP);
+    Rcpp::traits::input_parameter< const int >::type nthreads(nthreadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(psd_tree_cpp(comm, tips, e1, e2, EL, ntip, corr, compute_var, nthreads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// ses_cpp
+DataFrame ses_cpp(SEXP comm, SEXP Cmatrix, const int metric, const int null_model, const int runs, const int iterations, const double seed, const int nthreads);
+RcppExport SEXP _phyr_ses_cpp(SEXP commSEXP, SEXP CmatrixSEXP, SEXP metricSEXP, SEXP null_modelSEXP, SEXP runsSEXP, SEXP iterationsSEXP, SEXP seedSEXP, SEXP nthreadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type comm(commSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type Cmatrix(CmatrixSEXP);
+    Rcpp::traits::input_parameter< const int >::type metric(metricSEXP);
+    Rcpp::traits::input_parameter< const int >::type null_model(null_modelSEXP);
+    Rcpp::traits::input_parameter< const int >::type runs(runsSEXP);
+    Rcpp::traits::input_parameter< const int >::type iterations(iterationsSEXP);
+    Rcpp::traits::input_parameter< const double >::type seed(seedSEXP);
+    Rcpp::traits::input_parameter< const int >::type nthreads(nthreadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(ses_cpp(comm, Cmatrix, metric, null_model, runs, iterations, seed, nthreads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// psv_state_new_cpp
+SEXP psv_state_new_cpp(SEXP Cmatrix);
+RcppExport SEXP _phyr_psv_state_new_cpp(SEXP CmatrixSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type Cmatrix(CmatrixSEXP);
+    rcpp_result_gen = Rcpp::wrap(psv_state_new_cpp(Cmatrix));
+    return rcpp_result_gen;
+END_RCPP
+}
+// psv_state_add_cpp
+void psv_state_add_cpp(SEXP ptr, SEXP comm, const IntegerVector& cols, const CharacterVector& names);
+RcppExport SEXP _phyr_psv_state_add_cpp(SEXP ptrSEXP, SEXP commSEXP, SEXP colsSEXP, SEXP namesSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type ptr(ptrSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type comm(commSEXP);
+    Rcpp::traits::input_parameter< const IntegerVector& >::type cols(colsSEXP);
+    Rcpp::traits::input_parameter< const CharacterVector& >::type names(namesSEXP);
+    psv_state_add_cpp(ptr, comm, cols, names);
+    return R_NilValue;
+END_RCPP
+}
+// psv_state_remove_cpp
+void psv_state_remove_cpp(SEXP ptr, const CharacterVector& names);
+RcppExport SEXP _phyr_psv_state_remove_cpp(SEXP ptrSEXP, SEXP namesSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type ptr(ptrSEXP);
+    Rcpp::traits::input_parameter< const CharacterVector& >::type names(namesSEXP);
+    psv_state_remove_cpp(ptr, names);
+    return R_NilValue;
+END_RCPP
+}
+// psv_state_set_cpp
+void psv_state_set_cpp(SEXP ptr, const CharacterVector& names, const IntegerVector& sp, const NumericVector& value);
+RcppExport SEXP _phyr_psv_state_set_cpp(SEXP ptrSEXP, SEXP namesSEXP, SEXP spSEXP, SEXP valueSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type ptr(ptrSEXP);
+    Rcpp::traits::input_parameter< const CharacterVector& >::type names(namesSEXP);
+    Rcpp::traits::input_parameter< const IntegerVector& >::type sp(spSEXP);
+    Rcpp::traits::input_parameter< const NumericVector& >::type value(valueSEXP);
+    psv_state_set_cpp(ptr, names, sp, value);
+    return R_NilValue;
+END_RCPP
+}
+// psv_state_table_cpp
+DataFrame psv_state_table_cpp(SEXP ptr);
+RcppExport SEXP _phyr_psv_state_table_cpp(SEXP ptrSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type ptr(ptrSEXP);
+    rcpp_result_gen = Rcpp::wrap(psv_state_table_cpp(ptr));
+    return rcpp_result_gen;
+END_RCPP
+}
+// vcv_hash_cpp
+std::string vcv_hash_cpp(const IntegerVector& e1, const IntegerVector& e2, const NumericVector& EL, const CharacterVector& tips, const IntegerVector& flags);
+RcppExport SEXP _phyr_vcv_hash_cpp(SEXP e1SEXP, SEXP e2SEXP, SEXP ELSEXP, SEXP tipsSEXP, SEXP flagsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const IntegerVector& >::type e1(e1SEXP);
+    Rcpp::traits::input_parameter< const IntegerVector& >::type e2(e2SEXP);
+    Rcpp::traits::input_parameter< const NumericVector& >::type EL(ELSEXP);
+    Rcpp::traits::input_parameter< const CharacterVector& >::type tips(tipsSEXP);
+    Rcpp::traits::input_parameter< const IntegerVector& >::type flags(flagsSEXP);
+    rcpp_result_gen = Rcpp::wrap(vcv_hash_cpp(e1, e2, EL, tips, flags));
+    return rcpp_result_gen;
+END_RCPP
+}
+// vcv_write_cpp
+bool vcv_write_cpp(SEXP x, const std::string& path, const int& kind, const double& n);
+RcppExport SEXP _phyr_vcv_write_cpp(SEXP xSEXP, SEXP pathSEXP, SEXP kindSEXP, SEXP nSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type x(xSEXP);
+    Rcpp::traits::input_parameter< const std::string& >::type path(pathSEXP);
+    Rcpp::traits::input_parameter< const int& >::type kind(kindSEXP);
+    Rcpp::traits::input_parameter< const double& >::type n(nSEXP);
+    rcpp_result_gen = Rcpp::wrap(vcv_write_cpp(x, path, kind, n));
+    return rcpp_result_gen;
+END_RCPP
+}
+// vcv_read_cpp
+SEXP vcv_read_cpp(const std::string& path, const int& kind);
+RcppExport SEXP _phyr_vcv_read_cpp(SEXP pathSEXP, SEXP kindSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const std::string& >::type path(pathSEXP);
+    Rcpp::traits::input_parameter< const int& >::type kind(kindSEXP);
+    rcpp_result_gen = Rcpp::wrap(vcv_read_cpp(path, kind));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -396,8 +772,12 @@ static const R_CallMethodDef CallEntries[] = {
     {"_phyr_cor_phylo_LL", (DL_FUNC) &_phyr_cor_phylo_LL, 11},
     {"_phyr_cor_phylo_", (DL_FUNC) &_phyr_cor_phylo_, 15},
     {"_phyr_set_seed", (DL_FUNC) &_phyr_set_seed, 1},
-    {"_phyr_predict_cpp", (DL_FUNC) &_phyr_predict_cpp, 4},
-    {"_phyr_pcd2_loop", (DL_FUNC) &_phyr_pcd2_loop, 7},
+    {"_phyr_predict_cpp", (DL_FUNC) &_phyr_predict_cpp, 8},
+    {"_phyr_predict_hash_cpp", (DL_FUNC) &_phyr_predict_hash_cpp, 2},
+    {"_phyr_pcd2_loop", (DL_FUNC) &_phyr_pcd2_loop, 11},
+    {"_phyr_pcd2_cross", (DL_FUNC) &_phyr_pcd2_cross, 13},
+    {"_phyr_pcd_read_cpp", (DL_FUNC) &_phyr_pcd_read_cpp, 3},
+    {"_phyr_float_unpack_cpp", (DL_FUNC) &_phyr_float_unpack_cpp, 1},
     {"_phyr_pglmm_iV_logdetV_cpp", (DL_FUNC) &_phyr_pglmm_iV_logdetV_cpp, 8},
     {"_phyr_pglmm_V", (DL_FUNC) &_phyr_pglmm_V, 8},
     {"_phyr_pglmm_LL_cpp", (DL_FUNC) &_phyr_pglmm_LL_cpp, 11},
@@ -408,10 +788,32 @@ static const R_CallMethodDef CallEntries[] = {
     {"_phyr_pglmm_gaussian_LL_calc_cpp", (DL_FUNC) &_phyr_pglmm_gaussian_LL_calc_cpp, 7},
     {"_phyr_pglmm_gaussian_internal_cpp", (DL_FUNC) &_phyr_pglmm_gaussian_internal_cpp, 15},
     {"_phyr_which2", (DL_FUNC) &_phyr_which2, 1},
-    {"_phyr_vcv_loop", (DL_FUNC) &_phyr_vcv_loop, 7},
+    {"_phyr_vcv_tree_cpp", (DL_FUNC) &_phyr_vcv_tree_cpp, 5},
+    {"_phyr_vcv_tree_packed_cpp", (DL_FUNC) &_phyr_vcv_tree_packed_cpp, 6},
+    {"_phyr_packed_subset_cpp", (DL_FUNC) &_phyr_packed_subset_cpp, 2},
+    {"_phyr_packed_unpack_cpp", (DL_FUNC) &_phyr_packed_unpack_cpp, 1},
+    {"_phyr_vcv_sums_cpp", (DL_FUNC) &_phyr_vcv_sums_cpp, 1},
     {"_phyr_cov2cor_cpp", (DL_FUNC) &_phyr_cov2cor_cpp, 1},
-    {"_phyr_pse_cpp", (DL_FUNC) &_phyr_pse_cpp, 2},
-    {"_phyr_psv_cpp", (DL_FUNC) &_phyr_psv_cpp, 3},
+    {"_phyr_pse_cpp", (DL_FUNC) &_phyr_pse_cpp, 3},
+    {"_phyr_psv_cpp", (DL_FUNC) &_phyr_psv_cpp, 4},
+    {"_phyr_psv_spp_cpp", (DL_FUNC) &_phyr_psv_spp_cpp, 3},
+    {"_phyr_psv_batch_cpp", (DL_FUNC) &_phyr_psv_batch_cpp, 4},
+    {"_phyr_pse_batch_cpp", (DL_FUNC) &_phyr_pse_batch_cpp, 3},
+    {"_phyr_psv_tree_cpp", (DL_FUNC) &_phyr_psv_tree_cpp, 9},
+    {"_phyr_pse_tree_cpp", (DL_FUNC) &_phyr_pse_tree_cpp, 8},
+    {"_phyr_psc_tree_cpp", (DL_FUNC) &_phyr_psc_tree_cpp, 8},
+    {"_phyr_psc_cpp", (DL_FUNC) &_phyr_psc_cpp, 3},
+    {"_phyr_psd_cpp", (DL_FUNC) &_phyr_psd_cpp, 4},
+    {"_phyr_psd_tree_cpp", (DL_FUNC) &_phyr_psd_tree_cpp, 9},
+    {"_phyr_ses_cpp", (DL_FUNC) &_phyr_ses_cpp, 8},
+    {"_phyr_psv_state_new_cpp", (DL_FUNC) &_phyr_psv_state_new_cpp, 1},
+    {"_phyr_psv_state_add_cpp", (DL_FUNC) &_phyr_psv_state_add_cpp, 4},
+    {"_phyr_psv_state_remove_cpp", (DL_FUNC) &_phyr_psv_state_remove_cpp, 2},
+    {"_phyr_psv_state_set_cpp", (DL_FUNC) &_phyr_psv_state_set_cpp, 4},
+    {"_phyr_psv_state_table_cpp", (DL_FUNC) &_phyr_psv_state_table_cpp, 1},
+    {"_phyr_vcv_hash_cpp", (DL_FUNC) &_phyr_vcv_hash_cpp, 5},
+    {"_phyr_vcv_write_cpp", (DL_FUNC) &_phyr_vcv_write_cpp, 4},
+    {"_phyr_vcv_read_cpp", (DL_FUNC) &_phyr_vcv_read_cpp, 2},
     {NULL, NULL, 0}
 };
 
@@ -2,6 +2,13 @@
 
 // we only include RcppArmadillo.h which pulls Rcpp.h in for us
 #include "RcppArmadillo.h"
+#include "psv.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
 
 // via the depends attribute we tell Rcpp to create hooks for
 // RcppArmadillo so that the build process will know what to do
@@ -25,132 +32,1246 @@ void set_seed(unsigned int seed) {
   set_seed_r(seed);  
 }
 
+// k species picked from the n species of the pool by a partial Fisher-Yates
+// shuffle of `perm`, which is undone afterwards
+static void pick_species(const int& n, const int& k, std::vector<int>& perm,
+                         std::vector<int>& swaps, StreamRng& rng, uvec& pick){
+  pick.set_size(k);
+  swaps.resize(k);
+  for(int a = 0; a < k; a++){
+    swaps[a] = a + rng.below(n - a);
+    std::swap(perm[a], perm[swaps[a]]);
+    pick(a) = perm[a];
+  }
+  for(int a = k - 1; a >= 0; a--) std::swap(perm[a], perm[swaps[a]]);
+}
+
+static double ss11(const mat& S11){
+  const int n1 = S11.n_rows;
+  return (n1 * trace(S11) - accu(S11)) / (n1 * (n1 - 1));
+}
+
+// S11 = C11 - C12 C22^-1 C21 through the pseudo-inverse, for a singular C22
+static bool schur_pinv(const mat& C11, const mat& C12, const mat& C22, mat& S11){
+  mat invC22;
+  if(!pinv(invC22, C22)) return false;
+  S11 = C11 - C12 * invC22 * trans(C12);
+  return true;
+}
+
+// SS11 of one random draw for predict_cpp: n1 = 2 species, and independently
+// n2 others. S11 comes from a Cholesky factor of C22, or from its
+// pseudo-inverse if C22 is singular. Returns NaN if neither works. Does not
+// touch the R API.
+static double predict_draw(const CovInput& Vc, const int& n, const int& n2,
+                           std::vector<int>& perm, std::vector<int>& swaps,
+                           StreamRng& rng){
+  const int n1 = 2; // the number of n1 does not matter
+  uvec pick1, pick2;
+  pick_species(n, n1, perm, swaps, rng, pick1);
+  pick_species(n, n2, perm, swaps, rng, pick2);
+  
+  mat C11 = Vc.submat(pick1, pick1);
+  mat S11 = C11;
+  if(n2 > 0){
+    mat C12 = Vc.submat(pick1, pick2);
+    mat C22 = Vc.submat(pick2, pick2);
+    mat L;
+    if(chol(L, C22, "lower")){
+      mat Y = solve(trimatl(L), trans(C12)); // L Y = C21
+      S11 -= trans(Y) * Y;
+    } else if(!schur_pinv(C11, C12, C22, S11)){
+      return NA_REAL;
+    }
+  }
+  return ss11(S11);
+}
+
+// SS11 of one random draw for every richness level at once, into out[l]: the
+// n2 species of a level are the first n2 of one draw of nmax species. L being
+// lower triangular, the solve of L Y = C21 for the first n2 species is made
+// of the first n2 rows of the solve for all nmax species, so the Cholesky
+// factor of the largest C22 serves all levels, and C12 C22^-1 C21 of a level
+// is the sum of y y' over the first n2 rows of Y. `order` lists the levels by
+// increasing n2.
+static void predict_draw_nested(const CovInput& Vc, const int& n,
+                                const std::vector<int>& n2s,
+                                const std::vector<int>& order,
+                                std::vector<int>& perm, std::vector<int>& swaps,
+                                StreamRng& rng, double* out){
+  const int n1 = 2;
+  int nmax = n2s[order.back()];
+  uvec pick1, pick2;
+  pick_species(n, n1, perm, swaps, rng, pick1);
+  pick_species(n, nmax, perm, swaps, rng, pick2);
+  
+  mat C11 = Vc.submat(pick1, pick1);
+  mat C12 = Vc.submat(pick1, pick2);
+  mat C22 = Vc.submat(pick2, pick2);
+  mat L;
+  if(nmax > 0 && chol(L, C22, "lower")){
+    mat Y = solve(trimatl(L), trans(C12)); // nmax x n1
+    mat G(n1, n1, fill::zeros);
+    int row = 0;
+    for(size_t o = 0; o < order.size(); o++){
+      int l = order[o];
+      for(; row < n2s[l]; row++) G += trans(Y.row(row)) * Y.row(row);
+      out[l] = ss11(C11 - G);
+    }
+  } else {
+    // singular C22 (or no species at all): level by level
+    for(size_t l = 0; l < n2s.size(); l++){
+      int n2 = n2s[l];
+      mat S11 = C11;
+      if(n2 > 0 && !schur_pinv(C11, C12.cols(0, n2 - 1),
+                               C22.submat(0, 0, n2 - 1, n2 - 1), S11)){
+        out[l] = NA_REAL;
+        continue;
+      }
+      out[l] = ss11(S11);
+    }
+  }
+}
+
+// mean and standard error of the values x[0], x[stride], ... (count of them),
+// leaving out NaN
+static void draw_stats(const double* x, const int& stride, const int& count,
+                       double& mean, double& se){
+  int cnt = 0;
+  double sum = 0, ss = 0;
+  for(int r = 0; r < count; r++){
+    double v = x[(size_t)r * stride];
+    if(ISNAN(v)) continue;
+    cnt++;
+    sum += v;
+  }
+  mean = cnt > 0 ? sum / cnt : NA_REAL;
+  for(int r = 0; r < count; r++){
+    double v = x[(size_t)r * stride];
+    if(!ISNAN(v)) ss += (v - mean) * (v - mean);
+  }
+  se = cnt > 1 ? std::sqrt(ss / (cnt - 1) / cnt) : NA_REAL;
+}
+
+// Expected PSV of two species given nsr[l] other species of the pool, for each
+// l: the mean of SS11 over random draws. Draws run in batches of 100 over
+// threads, each on its own random stream (seed, n2, r), or (seed, r) when
+// nested, so results do not depend on the number of threads. With tol > 0, a
+// richness level stops once the standard error of its mean is below tol, and
+// after `reps` draws at most. The standard errors and numbers of draws are
+// returned as attributes "se" and "reps".
+// With `nested`, each draw serves all richness levels (see predict_draw_nested),
+// with one Cholesky factorization; draws then stop once all levels meet tol.
+// V is a numeric matrix or a packed_vcv (see vcv2)
 // [[Rcpp::export]]
-NumericVector predict_cpp(int n, const arma::vec& nsr, int reps, const arma::mat& V){
+NumericVector predict_cpp(int n, const arma::vec& nsr, int reps, SEXP V,
+                          double tol = 0, double seed = 1, int nthreads = 1,
+                          bool nested = false){
+  CovInput Vc(V);
+  if(n < 2) stop("The species pool needs at least 2 species.");
   int n_unique = nsr.size();
-  NumericVector SSii(n_unique); // to save results
-  int n1 = 2; // the number of n1 does not matter
-  IntegerVector n1_idx = seq_len(n1) - 1;
-
-  for(int n2 = 0; n2 < n_unique; n2++){
-    NumericVector temp(reps);
-    IntegerVector n2_idx = seq_len(nsr[n2]) - 1;
-    for(int t = 0; t < reps; t++){
-      // set_seed(t + 1);
-      IntegerVector rp = sample(n, n);
-      IntegerVector pick1 = rp[n1_idx];
-      IntegerVector pick1_1 = pick1 - 1;
-      arma::uvec pick1_arma = as<arma::uvec>(pick1_1); // convert to armadillo
-      
-      // set_seed(t + 10000);
-      IntegerVector rp2 = sample(n, n);
-      IntegerVector pick2 = rp2[n2_idx];
-      IntegerVector pick2_1 = pick2 - 1;
-      arma::uvec pick2_arma = as<arma::uvec>(pick2_1);
-      
-      arma::mat C11 = V.submat(pick1_arma, pick1_arma);
-      arma::mat C22 = V.submat(pick2_arma, pick2_arma);
-      arma::mat C12 = V.submat(pick1_arma, pick2_arma);
-      
-      arma::mat invC22 = inv(C22);
-      arma::mat S11 = C11 - C12 * invC22 * trans(C12);
-      double SS11 = (n1 * trace(S11) - accu(S11)) / (n1 * (n1 - 1));
-      temp[t] = SS11;
-    }
-    SSii[n2] = mean(temp);
+  NumericVector SSii(n_unique, NA_REAL); // to save results
+  NumericVector SE(n_unique, NA_REAL);
+  IntegerVector used(n_unique);
+  if(n_unique == 0) return SSii;
+  const int batch = 100;
+  uint64_t sd = (uint64_t)seed;
+  std::vector<int> n2s(n_unique), order(n_unique);
+  for(int l = 0; l < n_unique; l++){
+    n2s[l] = std::min((int)nsr[l], n);
+    order[l] = l;
+  }
+  std::sort(order.begin(), order.end(), [&n2s](int a, int b){ return n2s[a] < n2s[b]; });
+  std::vector<char> active(n_unique, 1);
+  int n_active = n_unique;
+  // draw r of level l at r * n_unique + l
+  std::vector<double> draws((size_t)reps * n_unique, NA_REAL);
+  
+  int done = 0;
+  // exceptions (e.g. failed allocations) cannot leave the threads: the first
+  // one is kept, the other threads skip their remaining draws, and it is
+  // raised as an R error after the parallel region
+  int failed = 0;
+  std::string msg;
+  while(done < reps && n_active > 0){
+    int r0 = done, r1 = std::min(reps, done + batch);
+#pragma omp parallel num_threads(n_threads(nthreads))
+{
+    std::vector<int> perm, swaps;
+#pragma omp for schedule(dynamic, 4)
+    for(int r = r0; r < r1; r++){
+      int stop_now;
+#pragma omp atomic read
+      stop_now = failed;
+      if(stop_now) continue;
+      try {
+        if(perm.empty()){
+          perm.resize(n);
+          for(int k = 0; k < n; k++) perm[k] = k;
+        }
+        double* out = &draws[(size_t)r * n_unique];
+        if(nested){
+          StreamRng rng(sd, ((uint64_t)1 << 63) | (uint64_t)r);
+          predict_draw_nested(Vc, n, n2s, order, perm, swaps, rng, out);
+        } else {
+          for(int l = 0; l < n_unique; l++){
+            if(!active[l]) continue;
+            StreamRng rng(sd, ((uint64_t)n2s[l] << 32) | (uint64_t)r);
+            out[l] = predict_draw(Vc, n, n2s[l], perm, swaps, rng);
+          }
+        }
+      } catch(std::exception& e) {
+#pragma omp critical(pcd_failed)
+{
+        if(!failed) msg = e.what();
+#pragma omp atomic write
+        failed = 1;
+}
+      }
+    }
+}
+    if(failed) stop(msg);
+    done = r1;
+    Rcpp::checkUserInterrupt();
+    
+    int n_met = 0;
+    for(int l = 0; l < n_unique; l++){
+      if(!active[l]) continue;
+      draw_stats(&draws[l], n_unique, done, SSii[l], SE[l]);
+      used[l] = done;
+      if(tol > 0 && !ISNAN(SE[l]) && SE[l] < tol){
+        n_met++;
+        if(!nested){
+          active[l] = 0;
+          n_active--;
+        }
+      }
+    }
+    if(nested && n_met == n_unique) break;
   }
+  SSii.attr("se") = SE;
+  SSii.attr("reps") = used;
   return SSii;
 }
 
+// Key of the expected PSVs of predict_cpp for the pool with var-cov matrix V
+// (a numeric matrix or a packed_vcv): a hash of V and of `params`, the other
+// arguments the draws depend on (see R/cache.R)
+// [[Rcpp::export]]
+std::string predict_hash_cpp(SEXP V, const NumericVector& params){
+  CovInput Vc(V);
+  Fnv64 f;
+  int dims[3] = {Vc.n, (int)Vc.kind, (int)params.size()};
+  f.add(dims, sizeof(dims));
+  f.add(Vc.values(), Vc.bytes());
+  f.add(params.begin(), params.size() * sizeof(double));
+  char out[17];
+  std::snprintf(out, sizeof(out), "%016llx", (unsigned long long)f.h);
+  return std::string(out);
+}
+
+// Cholesky factor of the covariances among the species of one site, with
+// their trace and sum, for pcd2_loop
+struct SiteFactor {
+  uvec sp;      // species of the site
+  mat L;        // lower triangular, C11 = L L'
+  double tr;
+  double sum;
+  bool ok;      // false if C11 is not positive definite
+};
+
+// What pcd2_loop needs of every site besides its factor
+struct PcdInput {
+  const SiteSets* sites;
+  const CovInput* Vc;
+  const std::vector<SiteFactor>* fac;
+  const std::vector<double>* ssii;
+  double SCii;
+  int nsp_pool;
+  const SiteBits* bits;  // NULL to merge the species lists instead
+};
+
+// Bitsets of the first site of each species set, if they are worth it: they
+// are used when they take at most two words per species of an average site,
+// where popcounts beat merging the lists, and they then take no more than four
+// times the memory of the lists.
+static SiteBits* pcd_bits(const SiteSets& sites, const std::vector<int>& first){
+  double words = (sites.nsp + 63) / 64;
+  if(sites.nsite == 0 || words > 2.0 * sites.idx.size() / sites.nsite) return NULL;
+  return new SiteBits(sites, first);
+}
+
+// A pair of sites of a tile. Entry 0 is for S11, given the second site, and
+// entry 1 for S22, given the first: k[v] species (u1, u2) at o[v] in
+// PcdScratch::sp that the site they are conditional on does not have, and the
+// trace and sum of S11 and S22 once solved.
+struct PairWork {
+  int a, b;
+  int n_inter;
+  int k[2];
+  size_t o[2];
+  double tr[2], sum[2];
+};
+
+// Scratch memory of one thread for the pairs of a tile, reused from batch to
+// batch so that solving a pair makes no allocation of its own
+struct PcdScratch {
+  std::vector<PairWork> pairs;
+  std::vector<int> sp;
+  std::vector<size_t> order, batch;
+  std::vector<double> rhs, cuu, rsum;
+};
+
+// Start of a block of n doubles in buf, aligned on a cache line (64 bytes)
+static double* aligned(std::vector<double>& buf, const size_t& n){
+  if(buf.size() < n + 8) buf.resize(std::max(n + 8, 2 * buf.size()));
+  uintptr_t p = reinterpret_cast<uintptr_t>(buf.data());
+  return reinterpret_cast<double*>((p + 63) & ~(uintptr_t)63);
+}
+
+// Largest block of right-hand sides solved at once, in doubles (2 MB)
+static const size_t pcd_batch_max = 1 << 18;
+
+// Solves L X = B in place for the k columns of B (n x k), with L lower
+// triangular (n x n), both column-major. Each column is solved on its own, in
+// the same order of operations whatever k.
+static void forward_solve(const double* L, const int& n, double* B, const size_t& k){
+  for(size_t c = 0; c < k; c++){
+    double* x = B + c * n;
+    for(int r = 0; r < n; r++){
+      const double* Lr = L + (size_t)r * n;
+      x[r] /= Lr[r];
+      double xr = x[r];
+      for(int q = r + 1; q < n; q++) x[q] -= Lr[q] * xr;
+    }
+  }
+}
+
+// Number of species sites i and j share, with the species of i that j does
+// not have into u1 (k1 of them) and those of j that i does not have into u2,
+// from the bitsets or from one merge of the sorted lists
+static int split_species(const PcdInput& in, const int& i, const int& j,
+                         int* u1, int& k1, int* u2, int& k2){
+  const SiteSets& sites = *in.sites;
+  int n1 = sites.richness(i), n2 = sites.richness(j);
+  const int* pick1 = sites.species(i);
+  const int* pick2 = sites.species(j);
+  if(in.bits){
+    k1 = in.bits->only_in(i, j, u1);
+    k2 = in.bits->only_in(j, i, u2);
+    return in.bits->shared(i, j);
+  }
+  int n_inter = 0;
+  k1 = 0;
+  k2 = 0;
+  for(int a = 0, b = 0; a < n1 || b < n2; ){
+    if(b >= n2 || (a < n1 && pick1[a] < pick2[b])){
+      u1[k1++] = pick1[a++];
+    } else if(a >= n1 || pick2[b] < pick1[a]){
+      u2[k2++] = pick2[b++];
+    } else {
+      n_inter++; a++; b++;
+    }
+  }
+  return n_inter;
+}
+
+// Trace and sum of C[u, u] - C[u, s] C[s, s]^-1 C[s, u] for a site whose C[s, s]
+// is not positive definite and thus has no factor
+static void cond_sums_pinv(const CovInput& Vc, const SiteFactor& F, const int* u,
+                           const int& k, double& tr, double& total){
+  uvec uu(k);
+  for(int t = 0; t < k; t++) uu(t) = u[t];
+  mat C12 = Vc.submat(F.sp, uu);
+  mat S = Vc.submat(uu, uu) - trans(C12) * pinv(Vc.submat(F.sp, F.sp)) * C12;
+  tr = trace(S);
+  total = accu(S);
+}
+
+// Entry v (see PairWork) of the pairs idx[0..np) of ws.pairs, all conditional
+// on site s: the trace and sum of C[u, u] - C[u, s] C[s, s]^-1 C[s, u] for the
+// species u each pair has beyond those of s. Given s, the species a pair
+// shares with it are known: their rows and columns are zero, so only those
+// of u are left. The C[s, u] of all pairs are laid side by side in one
+// aligned block and solved with the factor of s in a single pass, in batches
+// of up to pcd_batch_max values.
+static void cond_batch(const PcdInput& in, const int& s, const size_t* idx, const size_t& np,
+                       const int& v, PcdScratch& ws){
+  const CovInput& Vc = *in.Vc;
+  const SiteFactor& F = (*in.fac)[s];
+  int n = F.sp.n_elem;
+  for(size_t q = 0; q < np; ){
+    ws.batch.clear();
+    size_t ncol = 0;
+    for(; q < np; q++){
+      PairWork& p = ws.pairs[idx[q]];
+      int k = p.k[v];
+      p.tr[v] = 0;
+      p.sum[v] = 0;
+      if(n == 0 || k == 0) continue;
+      if(!F.ok){
+        cond_sums_pinv(Vc, F, ws.sp.data() + p.o[v], k, p.tr[v], p.sum[v]);
+        continue;
+      }
+      if(!ws.batch.empty() && (ncol + k) * n > pcd_batch_max) break;
+      ws.batch.push_back(idx[q]);
+      ncol += k;
+    }
+    if(ws.batch.empty()) continue;
+    
+    double* B = aligned(ws.rhs, ncol * n);
+    double* Y = B;
+    for(size_t t = 0; t < ws.batch.size(); t++){
+      const PairWork& p = ws.pairs[ws.batch[t]];
+      Vc.fill(F.sp.memptr(), n, ws.sp.data() + p.o[v], p.k[v], Y);
+      Y += (size_t)p.k[v] * n;
+    }
+    forward_solve(F.L.memptr(), n, B, ncol);
+    
+    // with L Y = C[s, u], C[u, s] C[s, s]^-1 C[s, u] = Y'Y, whose trace is the
+    // sum of squares of Y and whose sum is the squared norm of Y's row sums
+    double* rs = aligned(ws.rsum, n);
+    Y = B;
+    for(size_t t = 0; t < ws.batch.size(); t++){
+      PairWork& p = ws.pairs[ws.batch[t]];
+      int k = p.k[v];
+      const int* u = ws.sp.data() + p.o[v];
+      double* Cuu = aligned(ws.cuu, (size_t)k * k);
+      Vc.fill(u, k, u, k, Cuu);
+      double trC = 0, sumC = 0, ssq = 0, srs = 0;
+      for(int a = 0; a < k; a++) trC += Cuu[a * (k + 1)];
+      for(size_t a = 0; a < (size_t)k * k; a++) sumC += Cuu[a];
+      std::fill(rs, rs + n, 0.0);
+      for(int c = 0; c < k; c++, Y += n){
+        for(int r = 0; r < n; r++){
+          ssq += Y[r] * Y[r];
+          rs[r] += Y[r];
+        }
+      }
+      for(int r = 0; r < n; r++) srs += rs[r] * rs[r];
+      p.tr[v] = trC - ssq;
+      p.sum[v] = sumC - srs;
+    }
+  }
+}
+
+// PCD, PCDc, PCDp, D and dsor of sites i and j, into out[0..4], from the traces
+// and sums of S11 = C11 - C12 C22^-1 C21 and S22 = C22 - C21 C11^-1 C12 in p.
+// Every value is symmetric in the two sites, including its rounding.
+static void pcd_values(const PcdInput& in, const int& i, const int& j, const PairWork& p,
+                       double* out){
+  const SiteSets& sites = *in.sites;
+  int n1 = sites.richness(i);
+  int n2 = sites.richness(j);
+  int n_inter = p.n_inter;
+  const SiteFactor& F1 = (*in.fac)[i];
+  const SiteFactor& F2 = (*in.fac)[j];
+  
+  double trS11, sumS11, trS22, sumS22;
+  if(n1 == 0 || n2 == 0){
+    trS11 = F1.tr;
+    sumS11 = F1.sum;
+    trS22 = F2.tr;
+    sumS22 = F2.sum;
+  } else {
+    trS11 = p.tr[0];
+    sumS11 = p.sum[0];
+    trS22 = p.tr[1];
+    sumS22 = p.sum[1];
+  }
+  
+  double SC11;
+  double SS11;
+  double SC22;
+  double SS22;
+  
+  if(n1 > 1){
+    SC11 = (n1 * F1.tr - F1.sum) / double(n1 * (n1 - 1));
+    SS11 = (n1 * trS11 - sumS11) / double(n1 * (n1 - 1));
+  } else {
+    SC11 = (n1 * F1.tr - F1.sum) / double(n1 * n1);
+    SS11 = (n1 * trS11 - sumS11) / double(n1 * n1);
+  }
+  
+  if(n2 > 1){
+    SC22 = (n2 * F2.tr - F2.sum) / double(n2 * (n2 - 1));
+    SS22 = (n2 * trS22 - sumS22) / double(n2 * (n2 - 1));
+  } else {
+    SC22 = (n2 * F2.tr - F2.sum) / double(n2 * n2);
+    SS22 = (n2 * trS22 - sumS22) / double(n2 * n2);
+  }
+  double D = (n1 * SS11 + n2 * SS22) / double(n1 * SC11 + n2 * SC22);
+  double dsor = 1 - 2 * n_inter / double(n1 + n2);
+  double ssii_n2 = (*in.ssii)[j];
+  double ssii_n1 = (*in.ssii)[i];
+  double pred_D = (n1 * ssii_n2 + n2 * ssii_n1) / (n1 * in.SCii + n2 * in.SCii);
+  double pred_dsor = 1 - 2 * n1 * n2 / double((n1 + n2) * in.nsp_pool);
+  
+  out[0] = D/pred_D;
+  out[1] = dsor/pred_dsor;
+  out[2] = out[0]/out[1];
+  out[3] = D;
+  out[4] = dsor;
+}
+
+// PCD of the pairs of sites (rows[a], cols[b]) with a < nr and b < nc for which
+// keep(a, b), in batches: first those of each row, whose S22 are all given by
+// the site of the row, then those of each column, whose S11 are all given by
+// the site of the column. put(a, b, out) receives the values of each pair, as
+// pcd_values gives them. Returns the number of pairs.
+template <typename Keep, typename Put>
+static double pcd_block(const PcdInput& in, const int* rows, const int& nr, const int* cols,
+                        const int& nc, Keep keep, Put put, PcdScratch& ws){
+  const SiteSets& sites = *in.sites;
+  ws.pairs.clear();
+  ws.sp.clear();
+  for(int a = 0; a < nr; a++){
+    for(int b = 0; b < nc; b++){
+      if(!keep(a, b)) continue;
+      int i = rows[a], j = cols[b];
+      PairWork p;
+      p.a = a;
+      p.b = b;
+      p.o[0] = ws.sp.size();
+      p.o[1] = p.o[0] + sites.richness(i);
+      ws.sp.resize(p.o[1] + sites.richness(j));
+      p.n_inter = split_species(in, i, j, ws.sp.data() + p.o[0], p.k[0],
+                                ws.sp.data() + p.o[1], p.k[1]);
+      ws.pairs.push_back(p);
+    }
+  }
+  size_t np = ws.pairs.size();
+  
+  // pairs are in rows as they were added; then sort them by column
+  ws.order.resize(np);
+  for(size_t q = 0; q < np; q++) ws.order[q] = q;
+  for(size_t q0 = 0, q1; q0 < np; q0 = q1){
+    for(q1 = q0; q1 < np && ws.pairs[q1].a == ws.pairs[q0].a; q1++) {}
+    cond_batch(in, rows[ws.pairs[q0].a], &ws.order[q0], q1 - q0, 1, ws);
+  }
+  std::stable_sort(ws.order.begin(), ws.order.end(), [&](const size_t& x, const size_t& y){
+    return ws.pairs[x].b < ws.pairs[y].b;
+  });
+  for(size_t q0 = 0, q1; q0 < np; q0 = q1){
+    int b = ws.pairs[ws.order[q0]].b;
+    for(q1 = q0; q1 < np && ws.pairs[ws.order[q1]].b == b; q1++) {}
+    cond_batch(in, cols[b], &ws.order[q0], q1 - q0, 0, ws);
+  }
+  
+  double out[5];
+  for(size_t q = 0; q < np; q++){
+    const PairWork& p = ws.pairs[q];
+    pcd_values(in, rows[p.a], cols[p.b], p, out);
+    put(p.a, p.b, out);
+  }
+  return np;
+}
+
+// Metrics of pcd2_loop, in the order pcd_values gives them
+static const char* pcd_metrics[5] = {"PCD", "PCDc", "PCDp", "D_pairwise", "dsor_pairwise"};
+
+// Where pcd2_loop writes its values: for each metric asked for, the lower
+// triangle of the site by site matrix by columns, as in a "dist" object, in
+// double or as float32 values in a raw vector. For sites i < j, this is element
+// i (2m - i - 1) / 2 + (j - i - 1).
+struct PcdDist {
+  int m;
+  bool single;
+  std::vector<void*> data;  // per metric, NULL if not asked for
+  
+  size_t index(const int& i, const int& j) const {
+    return (size_t)i * (2 * (size_t)m - i - 1) / 2 + (j - i - 1);
+  }
+  void set(const int& v, const size_t& k, const double& x) {
+    if (!data[v]) return;
+    if (single) static_cast<float*>(data[v])[k] = (float)x;
+    else static_cast<double*>(data[v])[k] = x;
+  }
+  void copy(const size_t& to, const size_t& from) {
+    for (size_t v = 0; v < data.size(); v++) {
+      if (!data[v]) continue;
+      if (single) static_cast<float*>(data[v])[to] = static_cast<float*>(data[v])[from];
+      else static_cast<double*>(data[v])[to] = static_cast<double*>(data[v])[from];
+    }
+  }
+};
+
+// A block of pairs of sites (or of representative sites): a in [a0, a1), b in
+// [b0, b1), a <= b. `id` numbers the tiles row by row.
+struct PairTile {
+  int a0, a1, b0, b1;
+  size_t id;
+  double cost;
+};
+
+// Sums of the powers 0, 1 and 2 of `size` over blocks of bs
+static void block_sums(const std::vector<int>& size, const int& bs, std::vector<double>& S0,
+                       std::vector<double>& S1, std::vector<double>& S2){
+  int nb = (size.size() + bs - 1) / bs;
+  S0.assign(nb, 0);
+  S1.assign(nb, 0);
+  S2.assign(nb, 0);
+  for(size_t a = 0; a < size.size(); a++){
+    double n1 = size[a];
+    S0[a / bs] += 1;
+    S1[a / bs] += n1;
+    S2[a / bs] += n1 * n1;
+  }
+}
+
+// Tiles of bs x bs of the units (sites, or representatives of species sets)
+// with richness `size` (a) and `size2` (b); with `upper`, the two are the same
+// units and only tiles with a <= b are made. Their cost is estimated from the
+// triangular solves, about n1 n2 (n1 + n2) for a pair, so that the largest ones
+// can start first.
+static std::vector<PairTile> make_tiles(const std::vector<int>& size,
+                                        const std::vector<int>& size2, const int& bs,
+                                        const bool& upper){
+  int g = size.size(), g2 = size2.size();
+  std::vector<double> S0, S1, S2, T0, T1, T2;
+  block_sums(size, bs, S0, S1, S2);
+  block_sums(size2, bs, T0, T1, T2);
+  std::vector<PairTile> tiles;
+  for(size_t A = 0; A < S0.size(); A++){
+    for(size_t B = upper ? A : 0; B < T0.size(); B++){
+      PairTile t = {(int)A * bs, std::min(g, (int)(A + 1) * bs),
+                    (int)B * bs, std::min(g2, (int)(B + 1) * bs),
+                    tiles.size(), S2[A] * T1[B] + S1[A] * T2[B] + S0[A] * T0[B]};
+      if(upper && A == B) t.cost /= 2;
+      tiles.push_back(t);
+    }
+  }
+  return tiles;
+}
+
+// Run work(tile), which computes the pairs of a tile and returns how many there
+// were, for all tiles over threads. Threads take the tiles one at a time, largest
+// first, from a shared queue. The main thread reports progress and checks for
+// user interrupts between its tiles; after an interrupt, or an exception thrown
+// by `work`, the other threads skip their remaining tiles. Returns false if
+// interrupted, and stops with the exception's message if there was one.
+template <typename Work>
+static bool run_tiles(std::vector<PairTile> tiles, const double& npairs,
+                      const bool& verbose, const int& nth, Work work){
+  std::stable_sort(tiles.begin(), tiles.end(),
+                   [](const PairTile& x, const PairTile& y){ return x.cost > y.cost; });
+  double ndone = 0;  // pairs done so far, for progress
+  int shown = -1, stopped = 0, failed = 0;
+  std::string msg;
+#pragma omp parallel num_threads(nth)
+{
+#pragma omp for schedule(dynamic, 1)
+  for(size_t t = 0; t < tiles.size(); t++){
+    int stop_now;
+#pragma omp atomic read
+    stop_now = stopped;
+    if(stop_now) continue;
+    double cnt = 0;
+    try {
+      cnt = work(tiles[t]);
+    } catch(std::exception& e) {
+#pragma omp critical(pcd_failed)
+{
+      if(!failed) msg = e.what();
+      failed = 1;
+}
+#pragma omp atomic write
+      stopped = 1;
+    }
+#pragma omp atomic
+    ndone += cnt;
+    if(thread_id() == 0){
+      if(verbose){
+        double d;
+#pragma omp atomic read
+        d = ndone;
+        int pct = npairs > 0 ? (int)(100 * d / npairs) : 100;
+        if(pct != shown){
+          Rcout << "\rpcd: " << pct << "% of site pairs" << std::flush;
+          shown = pct;
+        }
+      }
+      if(pending_interrupt()){
+#pragma omp atomic write
+        stopped = 1;
+      }
+    }
+  }
+}
+  if(verbose) Rcout << (stopped ? "" : "\rpcd: 100% of site pairs") << std::endl;
+  if(failed) stop(msg);
+  return !stopped;
+}
+
+
+/*
+ ***************************************************************************************
+ ***************************************************************************************
+
+ Output files of pcd2_loop, for runs whose results do not fit in memory
+
+ A file holds a 48-byte header (PcdHeader), one byte per tile of sites that is 1
+ once the tile is written, zeros up to a multiple of 8 bytes, and then, for each
+ metric kept in the order of pcd_metrics, the lower triangle of its site by
+ site matrix by columns (as in a "dist" object), in double or in float32. The
+ values can thus be memory-mapped from the file. Tiles are written as they
+ are done, so that a run that stopped resumes from the tiles left to do, as long
+ as the data are the same: the header keeps a hash of them.
+
+ ***************************************************************************************
+ ***************************************************************************************
+ */
+
+static const char pcd_magic[8] = {'P', 'H', 'Y', 'R', 'P', 'C', 'D', '1'};
+
+struct PcdHeader {
+  char magic[8];
+  int32_t single;   // 1 for float32 values
+  int32_t metrics;  // bit v for metric v of pcd_metrics
+  int64_t m;        // number of sites
+  int64_t tile;     // sites on each side of a tile
+  int64_t ntiles;
+  uint64_t key;     // hash of the data
+};
+
+static int seek64(FILE* fp, const int64_t& off){
+#ifdef _WIN32
+  return _fseeki64(fp, off, SEEK_SET);
+#else
+  return fseeko(fp, (off_t)off, SEEK_SET);
+#endif
+}
+
+static int64_t pcd_data_offset(const int64_t& ntiles){
+  return (sizeof(PcdHeader) + ntiles + 7) / 8 * 8;
+}
+
+class PcdFile {
+public:
+  FILE* fp;
+  PcdHeader hdr;
+  std::vector<unsigned char> done;  // per tile
+  std::vector<int> slot;            // place of each metric in the file, -1 if not kept
+  int64_t len, data_off;
+  size_t es;                        // bytes per value
+  
+  PcdFile() : fp(NULL) {}
+  ~PcdFile() { if(fp) std::fclose(fp); }
+  
+  // Opens `path` for the results described by `want`; an existing file of the
+  // same run keeps its finished tiles, any other file is an error.
+  void open(const std::string& path, const PcdHeader& want){
+    hdr = want;
+    len = hdr.m * (hdr.m - 1) / 2;
+    es = hdr.single ? sizeof(float) : sizeof(double);
+    data_off = pcd_data_offset(hdr.ntiles);
+    int nm = 0;
+    slot.assign(5, -1);
+    for(int v = 0; v < 5; v++) if(hdr.metrics & (1 << v)) slot[v] = nm++;
+    int64_t size = data_off + nm * len * (int64_t)es;
+    done.assign(hdr.ntiles, 0);
+    
+    fp = std::fopen(path.c_str(), "r+b");
+    if(fp){
+      PcdHeader old;
+      bool same = std::fread(&old, sizeof(old), 1, fp) == 1 &&
+        std::memcmp(&old, &hdr, sizeof(old)) == 0 &&
+        (hdr.ntiles == 0 || std::fread(done.data(), hdr.ntiles, 1, fp) == 1);
+      if(!same) stop("The file " + path + " holds pcd results of other data.");
+      return;
+    }
+    fp = std::fopen(path.c_str(), "w+b");
+    if(!fp) stop("Could not create the file " + path + ".");
+    char zero = 0;
+    bool ok = std::fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+      (hdr.ntiles == 0 || std::fwrite(done.data(), hdr.ntiles, 1, fp) == 1) &&
+      (size <= (int64_t)sizeof(hdr) + hdr.ntiles ||
+       (seek64(fp, size - 1) == 0 && std::fwrite(&zero, 1, 1, fp) == 1)) &&
+      std::fflush(fp) == 0;
+    if(!ok) stop("Could not write the file " + path + ".");
+  }
+  
+  // Writes the values of tile t, `vals[v]` holding those of metric v row by
+  // row of the tile, and marks the tile as done. Called by one thread at a time.
+  bool write(const PairTile& T, const std::vector<std::vector<char> >& vals){
+    bool ok = true;
+    for(int v = 0; v < 5 && ok; v++){
+      if(slot[v] < 0) continue;
+      int64_t base = data_off + slot[v] * len * (int64_t)es;
+      const char* p = vals[v].data();
+      for(int i = T.a0; i < T.a1 && ok; i++){
+        int j0 = std::max(T.b0, i + 1);
+        if(j0 >= T.b1) continue;
+        int64_t k = (int64_t)i * (2 * hdr.m - i - 1) / 2 + (j0 - i - 1);
+        size_t bytes = (size_t)(T.b1 - j0) * es;
+        ok = seek64(fp, base + k * (int64_t)es) == 0 && std::fwrite(p, bytes, 1, fp) == 1;
+        p += bytes;
+      }
+    }
+    // the tile only counts as done once its values are out
+    unsigned char one = 1;
+    ok = ok && std::fflush(fp) == 0 &&
+      seek64(fp, sizeof(PcdHeader) + T.id) == 0 && std::fwrite(&one, 1, 1, fp) == 1 &&
+      std::fflush(fp) == 0;
+    if(ok) done[T.id] = 1;
+    return ok;
+  }
+};
+
+// Hash of everything the values of pcd2_loop depend on
+static uint64_t pcd_key(const SiteSets& sites, const CovInput& Vc,
+                        const std::vector<double>& ssii, const double& SCii,
+                        const int& nsp_pool){
+  Fnv64 f;
+  int dims[3] = {sites.nsite, Vc.n, nsp_pool};
+  f.add(dims, sizeof(dims));
+  for(int i = 0; i < sites.nsite; i++){
+    int n1 = sites.richness(i);
+    f.add(&n1, sizeof(n1));
+    f.add(sites.species(i), n1 * sizeof(int));
+  }
+  f.add(ssii.data(), ssii.size() * sizeof(double));
+  f.add(&SCii, sizeof(SCii));
+  f.add(Vc.values(), Vc.bytes());
+  return f.h;
+}
+
+
+// Each site's submatrix of V is factored once, instead of being inverted for
+// each of its pairs; pairs then only need triangular solves. Only the first
+// site of each species set is factored (first[i] == i), and ssii[i] is the
+// expected PSV for the richness of site i.
+static void pcd_factors(const SiteSets& sites, const CovInput& Vc, const arma::vec& SSii,
+                        const arma::vec& nsr, const std::vector<int>& first, const int& nth,
+                        std::vector<SiteFactor>& fac, std::vector<double>& ssii){
+  int m = sites.nsite;
+  fac.assign(m, SiteFactor());
+  ssii.resize(m);
+  for(int i = 0; i < m; i++){
+    uvec which_n1 = find(nsr == sites.richness(i));
+    ssii[i] = as_scalar(SSii.elem(which_n1));
+  }
+  // an exception in a thread (e.g. a failed allocation for a large site) is
+  // kept and raised after the parallel region, as in run_tiles
+  int failed = 0;
+  std::string msg;
+#pragma omp parallel for schedule(dynamic, 16) num_threads(nth)
+  for(int i = 0; i < m; i++){
+    int stop_now;
+#pragma omp atomic read
+    stop_now = failed;
+    if(stop_now || first[i] != i) continue;
+    try {
+      int n1 = sites.richness(i);
+      SiteFactor& F = fac[i];
+      F.sp.set_size(n1);
+      for(int k = 0; k < n1; k++) F.sp(k) = sites.species(i)[k];
+      mat C11 = Vc.submat(F.sp, F.sp);
+      F.tr = trace(C11);
+      F.sum = accu(C11);
+      F.ok = chol(F.L, C11, "lower");
+    } catch(std::exception& e) {
+#pragma omp critical(pcd_failed)
+{
+      if(!failed) msg = e.what();
+#pragma omp atomic write
+      failed = 1;
+}
+    }
+  }
+  if(failed) stop(msg);
+}
+
+// Pairwise PCD of the sites of comm. Pairs are cut into tiles that are run over
+// threads (see run_tiles); each pair is computed by one thread from the same
+// inputs whatever the number of threads, so results do not depend on it.
+// Each metric is returned as the lower triangle of its site by site matrix (see
+// PcdDist); `metrics` (logical, by default all of them) picks the metrics, in
+// the order of pcd_metrics, and `single` stores them as float32 in raw vectors.
+// With a `file`, the values are written to it instead, tile by tile (see
+// PcdFile), and only the tiles not yet in the file are computed.
 // [[Rcpp::export]]
-List pcd2_loop(arma::vec SSii, arma::vec nsr, double SCii, const arma::mat& comm, 
-               const arma::mat& V, int nsp_pool, bool verbose){
-  int m = comm.n_rows;
-  int n = comm.n_cols;
-  NumericMatrix PCD(m, m);
-  NumericMatrix PCDc(m, m);
-  NumericMatrix PCDp(m, m);
-  NumericMatrix D_pairwise(m, m);
-  NumericMatrix dsor_pairwise(m, m);
-  IntegerVector nn = seq_len(n);
-  vec nna = as<vec>(nn);
-  
-  for(int i = 0; i < (m - 1); i++){
-    if (verbose) {Rcout << i + 1 << " " ;}
-    for(int j = i + 1; j < m; j++){
-      // Rcout << "Rows: " << j + 1 << std::endl ;
-      uvec c_i = find(comm.row(i) == 1);
-      uvec c_j = find(comm.row(j) == 1);
-      vec pick1 = nna.elem(c_i);
-      vec pick2 = nna.elem(c_j);
-      IntegerVector pick1_cpp = wrap(pick1);
-      IntegerVector pick2_cpp = wrap(pick2);
-      IntegerVector pick_inter = intersect(pick1_cpp, pick2_cpp);
-      
-      vec pick12 = join_cols(pick1, pick2); // how to convert to a uvec?
-      IntegerVector pick12_int = wrap(pick12);
-      IntegerVector pick12_intc = pick12_int - 1; // c++ starts at 0
-      uvec pick12_uvec = as<uvec>(pick12_intc);
-      
-      int n1 = pick1.size();
-      int n2 = pick2.size();
-      
-      mat C = V.submat(pick12_uvec, pick12_uvec);
-      mat C11 = C.submat(0, 0, n1 - 1, n1 - 1);
-      mat C22 = C.submat(n1, n1, n1+n2-1, n1+n2-1);
-      mat C12 = C.submat(0, n1, n1-1, n1+n2-1);
-      
-      mat invC11 = inv(C11);
-      mat S22 = C22 - trans(C12) * invC11 * C12; // n2 by n2 matrix
-      
-      mat invC22 = inv(C22);
-      mat S11 = C11 - C12 * invC22 * trans(C12); // n2 by n2 matrix
-      
-      double SC11;
-      double SS11;
-      double SC22;
-      double SS22;
-      
-      if(n1 > 1){
-        SC11 = (n1 * trace(C11) - accu(C11)) / double(n1 * (n1 - 1));
-        SS11 = (n1 * trace(S11) - accu(S11)) / double(n1 * (n1 - 1));
-      } else {
-        SC11 = (n1 * trace(C11) - accu(C11)) / double(n1 * n1);
-        SS11 = (n1 * trace(S11) - accu(S11)) / double(n1 * n1);
-      }
-      
-      if(n2 > 1){
-        SC22 = (n2 * trace(C22) - accu(C22)) / double(n2 * (n2 - 1));
-        SS22 = (n2 * trace(S22) - accu(S22)) / double(n2 * (n2 - 1));
-      } else {
-        SC22 = (n2 * trace(C22) - accu(C22)) / double(n2 * n2);
-        SS22 = (n2 * trace(S22) - accu(S22)) / double(n2 * n2);
-      }
-      double D = (n1 * SS11 + n2 * SS22) / double(n1 * SC11 + n2 * SC22);
-      double dsor = 1 - 2 * pick_inter.size() / double(n1 + n2);
-      uvec which_n2 = find(nsr == n2) ;
-      uvec which_n1 = find(nsr == n1) ;
-      double ssii_n2 = as_scalar(SSii.elem(which_n2));
-      double ssii_n1 = as_scalar(SSii.elem(which_n1));
-      double pred_D = (n1 * ssii_n2 + n2 * ssii_n1) / (n1 * SCii + n2 * SCii);
-      double pred_dsor = 1 - 2 * n1 * n2 / double((n1 + n2) * nsp_pool);
-      
-      double PCDij = D/pred_D;
-      double PCDcij = dsor/pred_dsor;
-      double PCDpij = PCDij/PCDcij;
-      PCD(i, j) = PCDij;
-      PCDc(i, j) = PCDcij;
-      PCDp(i, j) = PCDpij;
-      D_pairwise(i, j) = D;
-      dsor_pairwise(i, j) = dsor;
-    }
-  }
-  
-  return List::create(
-    _["PCD"] = PCD,
-    _["PCDc"] = PCDc,
-    _["PCDp"] = PCDp,
-    _["D_pairwise"] = D_pairwise,
-    _["dsor_pairwise"] = dsor_pairwise
-  );
-}
\ No newline at end of file
+List pcd2_loop(arma::vec SSii, arma::vec nsr, double SCii, SEXP comm, 
+               SEXP V, int nsp_pool, bool verbose, int nthreads = 1,
+               SEXP metrics = R_NilValue, bool single = false, std::string file = ""){
+  // species lists of all sites, from dense or sparse community data
+  SiteSets sites = as_site_sets(comm);
+  CovInput Vc(V);
+  int m = sites.nsite;
+  int nth = n_threads(nthreads);
+  std::vector<char> want(5);
+  for(int v = 0; v < 5; v++) want[v] = Rf_isNull(metrics) || LogicalVector(metrics)[v];
+  
+  // sites with the same species set give the same values, so only the first
+  // site of each set (its representative) is used: each pair of sets is
+  // computed once, into the cell of its two representatives, or of the
+  // representative and the second site of the set for pairs within a set
+  std::vector<int> first = site_first_copy(sites, false);
+  std::vector<int> rep, group(m), second;
+  for(int i = 0; i < m; i++){
+    if(first[i] == i){
+      group[i] = rep.size();
+      rep.push_back(i);
+      second.push_back(-1);
+    } else {
+      group[i] = group[first[i]];
+      if(second[group[i]] < 0) second[group[i]] = i;
+    }
+  }
+  int g = rep.size();
+  
+  std::vector<SiteFactor> fac;
+  std::vector<double> ssii;
+  pcd_factors(sites, Vc, SSii, nsr, first, nth, fac, ssii);
+  std::unique_ptr<SiteBits> bits(pcd_bits(sites, first));
+  PcdInput in = {&sites, &Vc, &fac, &ssii, SCii, nsp_pool, bits.get()};
+  
+  if(!file.empty()){
+    // Tiles of 256 x 256 sites, each written as soon as it is done. Pairs of
+    // repeated species sets are computed again, since the values they would
+    // copy may be in the file only.
+    PcdHeader hdr;
+    std::memset(&hdr, 0, sizeof(hdr));
+    std::memcpy(hdr.magic, pcd_magic, sizeof(pcd_magic));
+    hdr.single = single;
+    for(int v = 0; v < 5; v++) if(want[v]) hdr.metrics |= 1 << v;
+    hdr.m = m;
+    hdr.tile = 256;
+    std::vector<int> size(m);
+    for(int i = 0; i < m; i++) size[i] = sites.richness(i);
+    std::vector<PairTile> all = make_tiles(size, size, hdr.tile, true), tiles;
+    hdr.ntiles = all.size();
+    hdr.key = pcd_key(sites, Vc, ssii, SCii, nsp_pool);
+    PcdFile out;
+    out.open(file, hdr);
+    double npairs = 0;
+    for(size_t t = 0; t < all.size(); t++){
+      if(out.done[t]) continue;
+      tiles.push_back(all[t]);
+      const PairTile& T = all[t];
+      for(int i = T.a0; i < T.a1; i++) npairs += std::max(0, T.b1 - std::max(T.b0, i + 1));
+    }
+    bool finished = run_tiles(tiles, npairs, verbose, nth, [&](const PairTile& T){
+      // the run of row i of the tile starts at value start[i - a0]; the tile
+      // is computed in blocks of 32 x 32 sites
+      std::vector<size_t> start(T.a1 - T.a0 + 1, 0);
+      for(int i = T.a0; i < T.a1; i++){
+        start[i - T.a0 + 1] = start[i - T.a0] + std::max(0, T.b1 - std::max(T.b0, i + 1));
+      }
+      size_t es = single ? sizeof(float) : sizeof(double);
+      std::vector<std::vector<char> > vals(5);
+      for(int v = 0; v < 5; v++) if(want[v]) vals[v].resize(start.back() * es);
+      PcdScratch ws;
+      std::vector<int> rows, cols;
+      double cnt = 0;
+      for(int a0 = T.a0; a0 < T.a1; a0 += 32){
+        for(int b0 = T.b0; b0 < T.b1; b0 += 32){
+          int a1 = std::min(T.a1, a0 + 32), b1 = std::min(T.b1, b0 + 32);
+          if(b1 <= a0 + 1) continue;
+          rows.assign(first.begin() + a0, first.begin() + a1);
+          cols.assign(first.begin() + b0, first.begin() + b1);
+          cnt += pcd_block(in, rows.data(), a1 - a0, cols.data(), b1 - b0,
+                           [&](const int& a, const int& b){ return b0 + b > a0 + a; },
+                           [&](const int& a, const int& b, const double* out5){
+            int i = a0 + a, j = b0 + b;
+            size_t k = (start[i - T.a0] + j - std::max(T.b0, i + 1)) * es;
+            for(int v = 0; v < 5; v++){
+              if(!want[v]) continue;
+              if(single){
+                float x = (float)out5[v];
+                std::memcpy(&vals[v][k], &x, es);
+              } else {
+                std::memcpy(&vals[v][k], &out5[v], es);
+              }
+            }
+          }, ws);
+        }
+      }
+      bool ok;
+#pragma omp critical(pcd_file)
+      ok = out.write(T, vals);
+      if(!ok) throw std::runtime_error("Could not write the file " + file + ".");
+      return cnt;
+    });
+    if(!finished) stop("pcd was interrupted; run it again with the same file to resume.");
+    return List::create(_["file"] = file);
+  }
+  
+  size_t len = (size_t)m * (m - 1) / 2;
+  List res_out;
+  PcdDist res = {m, single, std::vector<void*>(5, (void*)NULL)};
+  for(int v = 0; v < 5; v++){
+    if(!want[v]) continue;
+    if(single){
+      RawVector x(len * sizeof(float));
+      res.data[v] = x.begin();
+      res_out[pcd_metrics[v]] = x;
+    } else {
+      NumericVector x(len);
+      res.data[v] = x.begin();
+      res_out[pcd_metrics[v]] = x;
+    }
+  }
+  
+  // Tiles of up to 32 x 32 representatives, small enough to give every thread
+  // many of them.
+  int bs = std::min(32, std::max(4, g / (int)std::ceil(std::sqrt(32.0 * nth))));
+  std::vector<int> size(g);
+  for(int a = 0; a < g; a++) size[a] = sites.richness(rep[a]);
+  double npairs = (double)g * (g - 1) / 2;
+  for(int a = 0; a < g; a++) if(second[a] >= 0) npairs++;
+  bool finished = run_tiles(make_tiles(size, size, bs, true), npairs, verbose, nth,
+                            [&](const PairTile& T){
+    PcdScratch ws;
+    return pcd_block(in, &rep[T.a0], T.a1 - T.a0, &rep[T.b0], T.b1 - T.b0,
+                     [&](const int& a, const int& b){
+      int A = T.a0 + a, B = T.b0 + b;
+      return B > A || (B == A && second[A] >= 0);
+    }, [&](const int& a, const int& b, const double* out){
+      int A = T.a0 + a, B = T.b0 + b;
+      size_t k = res.index(rep[A], A == B ? second[A] : rep[B]);
+      for(int v = 0; v < 5; v++) res.set(v, k, out[v]);
+    }, ws);
+  });
+  if(!finished) stop("pcd was interrupted.");
+  
+  // the other pairs of sites copy the cell of their pair of species sets
+  if(g < m){
+    for(int i = 0; i < m - 1; i++){
+      for(int j = i + 1; j < m; j++){
+        int a = std::min(group[i], group[j]), b = std::max(group[i], group[j]);
+        size_t c = res.index(rep[a], a == b ? second[a] : rep[b]);
+        size_t ij = res.index(i, j);
+        if(c != ij) res.copy(ij, c);
+      }
+    }
+  }
+  
+  return res_out;
+}
+
+// PCD between the sites of comm and those of comm_2, whose species are cols
+// and cols_2 (0-based, -1 for species not in V) of V: for every pair, as
+// matrices with the sites of comm as rows and those of comm_2 as columns, or
+// with `paired`, for site i of comm and site i of comm_2 only, as vectors.
+// `metrics` is as in pcd2_loop. Results do not depend on the number of threads.
+// [[Rcpp::export]]
+List pcd2_cross(arma::vec SSii, arma::vec nsr, double SCii, SEXP comm, SEXP comm_2,
+                const IntegerVector& cols, const IntegerVector& cols_2, SEXP V,
+                int nsp_pool, bool verbose, int nthreads = 1, SEXP metrics = R_NilValue,
+                bool paired = false){
+  SiteSets s1 = as_site_sets(comm), s2 = as_site_sets(comm_2);
+  CovInput Vc(V);
+  if(cols.size() != s1.nsp || cols_2.size() != s2.nsp) stop("One column index per species is needed.");
+  for(int k = 0; k < cols.size(); k++){
+    if(cols[k] < -1 || cols[k] >= Vc.n) stop("Column index out of range.");
+  }
+  for(int k = 0; k < cols_2.size(); k++){
+    if(cols_2[k] < -1 || cols_2[k] >= Vc.n) stop("Column index out of range.");
+  }
+  int m1 = s1.nsite, m2 = s2.nsite;
+  if(paired && m1 != m2) stop("comm and comm_2 need the same number of sites.");
+  // the sites of comm, then those of comm_2, with the species of V
+  SiteSets sites = SiteSets::stack(s1, cols.begin(), s2, cols_2.begin(), Vc.n);
+  int nth = n_threads(nthreads);
+  
+  std::vector<int> first = site_first_copy(sites, false);
+  std::vector<SiteFactor> fac;
+  std::vector<double> ssii;
+  pcd_factors(sites, Vc, SSii, nsr, first, nth, fac, ssii);
+  std::unique_ptr<SiteBits> bits(pcd_bits(sites, first));
+  PcdInput in = {&sites, &Vc, &fac, &ssii, SCii, nsp_pool, bits.get()};
+  
+  List res_out;
+  std::vector<double*> res(5, (double*)NULL);
+  for(int v = 0; v < 5; v++){
+    if(!Rf_isNull(metrics) && !LogicalVector(metrics)[v]) continue;
+    if(paired){
+      NumericVector x(m1);
+      res[v] = x.begin();
+      res_out[pcd_metrics[v]] = x;
+    } else {
+      NumericMatrix x(m1, m2);
+      res[v] = x.begin();
+      res_out[pcd_metrics[v]] = x;
+    }
+  }
+  
+  if(paired){
+    // blocks of 64 rows, through run_tiles for its progress and interrupts;
+    // a tile stands for its rows a0 to a1 here, paired with the same rows
+    std::vector<PairTile> tiles;
+    for(int a0 = 0; a0 < m1; a0 += 64){
+      PairTile t = {a0, std::min(m1, a0 + 64), 0, 0, tiles.size(), 0};
+      for(int i = t.a0; i < t.a1; i++){
+        double n1 = sites.richness(i), n2 = sites.richness(m1 + i);
+        t.cost += n1 * n2 * (n1 + n2) + 1;
+      }
+      tiles.push_back(t);
+    }
+    bool finished = run_tiles(tiles, m1, verbose, nth, [&](const PairTile& T){
+      PcdScratch ws;
+      for(int i = T.a0; i < T.a1; i++){
+        pcd_block(in, &first[i], 1, &first[m1 + i], 1,
+                  [](const int& a, const int& b){ return true; },
+                  [&](const int& a, const int& b, const double* out){
+          for(int v = 0; v < 5; v++) if(res[v]) res[v][i] = out[v];
+        }, ws);
+      }
+      return (double)(T.a1 - T.a0);
+    });
+    if(!finished) stop("pcd was interrupted.");
+    return res_out;
+  }
+  
+  // the first site of each species set in comm (rep1) and in comm_2 (rep2):
+  // each pair of sets is computed once, into the cell of these two sites
+  std::vector<int> pos(m1 + m2, -1), rep1, rep2, g1(m1), g2(m2);
+  for(int i = 0; i < m1; i++){
+    if(pos[first[i]] < 0){
+      pos[first[i]] = rep1.size();
+      rep1.push_back(i);
+    }
+    g1[i] = pos[first[i]];
+  }
+  pos.assign(m1 + m2, -1);
+  for(int j = 0; j < m2; j++){
+    if(pos[first[m1 + j]] < 0){
+      pos[first[m1 + j]] = rep2.size();
+      rep2.push_back(j);
+    }
+    g2[j] = pos[first[m1 + j]];
+  }
+  int G1 = rep1.size(), G2 = rep2.size();
+  std::vector<int> size1(G1), size2(G2);
+  for(int a = 0; a < G1; a++) size1[a] = sites.richness(rep1[a]);
+  for(int b = 0; b < G2; b++) size2[b] = sites.richness(m1 + rep2[b]);
+  
+  // tiles of up to 32 x 32 representatives, at least 16 per thread if there
+  // are enough pairs
+  int bs = std::min(32, std::max(4, (int)std::sqrt((double)G1 * G2 / (16.0 * nth))));
+  bool finished = run_tiles(make_tiles(size1, size2, bs, false), (double)G1 * G2, verbose,
+                            nth, [&](const PairTile& T){
+    std::vector<int> rows, cols;
+    for(int a = T.a0; a < T.a1; a++) rows.push_back(first[rep1[a]]);
+    for(int b = T.b0; b < T.b1; b++) cols.push_back(first[m1 + rep2[b]]);
+    PcdScratch ws;
+    return pcd_block(in, rows.data(), rows.size(), cols.data(), cols.size(),
+                     [](const int& a, const int& b){ return true; },
+                     [&](const int& a, const int& b, const double* out){
+      size_t c = rep1[T.a0 + a] + (size_t)rep2[T.b0 + b] * m1;
+      for(int v = 0; v < 5; v++) if(res[v]) res[v][c] = out[v];
+    }, ws);
+  });
+  if(!finished) stop("pcd was interrupted.");
+  
+  if(G1 < m1 || G2 < m2){
+    for(int j = 0; j < m2; j++){
+      for(int i = 0; i < m1; i++){
+        size_t c = rep1[g1[i]] + (size_t)rep2[g2[j]] * m1;
+        size_t ij = i + (size_t)j * m1;
+        if(c == ij) continue;
+        for(int v = 0; v < 5; v++) if(res[v]) res[v][ij] = res[v][c];
+      }
+    }
+  }
+  return res_out;
+}
+
+// Closes a file when it goes out of scope, e.g. on a stop()
+struct FileCloser {
+  FILE* fp;
+  ~FileCloser() { if(fp) std::fclose(fp); }
+};
+
+// Metrics `metrics` (logical, in the order of pcd_metrics) from a finished
+// output file of pcd2_loop, as it would have returned them, among all sites or
+// only among `sites` (0-based, increasing). Only the rows of the sites read are
+// held in memory besides the results. The list has the number of sites read as
+// attribute "Size" and whether values are float32 as attribute "single".
+// [[Rcpp::export]]
+List pcd_read_cpp(const std::string& path, const LogicalVector& metrics,
+                  SEXP sites = R_NilValue){
+  PcdHeader hdr;
+  {
+    FileCloser f = {std::fopen(path.c_str(), "rb")};
+    if(!f.fp) stop("Could not open the file " + path + ".");
+    std::vector<unsigned char> done;
+    bool ok = std::fread(&hdr, sizeof(hdr), 1, f.fp) == 1 &&
+      std::memcmp(hdr.magic, pcd_magic, sizeof(pcd_magic)) == 0 && hdr.ntiles >= 0;
+    if(ok){
+      done.resize(hdr.ntiles);
+      ok = hdr.ntiles == 0 || std::fread(done.data(), hdr.ntiles, 1, f.fp) == 1;
+    }
+    if(!ok) stop("The file " + path + " does not hold pcd results.");
+    for(size_t t = 0; t < done.size(); t++){
+      if(!done[t]) stop("The pcd results in " + path + " are not finished; run pcd again with this file to resume.");
+    }
+  }
+  int64_t m = hdr.m;
+  std::vector<int64_t> sub;
+  if(Rf_isNull(sites)){
+    sub.resize(m);
+    for(int64_t i = 0; i < m; i++) sub[i] = i;
+  } else {
+    IntegerVector sv(sites);
+    for(int a = 0; a < sv.size(); a++){
+      if(sv[a] < 0 || sv[a] >= m || (a > 0 && sv[a] <= sv[a - 1])) {
+        stop("sites need to be increasing indices of sites in the file.");
+      }
+      sub.push_back(sv[a]);
+    }
+  }
+  int64_t k = sub.size(), len = k * (k - 1) / 2, len_file = m * (m - 1) / 2;
+  size_t es = hdr.single ? sizeof(float) : sizeof(double);
+  
+  // results are allocated before the file is opened, since R allocation
+  // errors do not return
+  List out;
+  std::vector<char*> dest(5, (char*)NULL);
+  for(int v = 0; v < 5; v++){
+    if(!(hdr.metrics & (1 << v)) || !metrics[v]) continue;
+    SEXP x = PROTECT(hdr.single ? Rf_allocVector(RAWSXP, len * es) : Rf_allocVector(REALSXP, len));
+    dest[v] = hdr.single ? (char*)RAW(x) : (char*)REAL(x);
+    out[pcd_metrics[v]] = x;
+    UNPROTECT(1);
+  }
+  
+  FileCloser f = {std::fopen(path.c_str(), "rb")};
+  if(!f.fp) stop("Could not open the file " + path + ".");
+  bool ok = true;
+  std::vector<char> buf;
+  int slot = 0;
+  for(int v = 0; v < 5 && ok; v++){
+    if(!(hdr.metrics & (1 << v))) continue;
+    int64_t off = pcd_data_offset(hdr.ntiles) + slot++ * len_file * (int64_t)es;
+    if(!dest[v]) continue;
+    if(k == m){
+      ok = seek64(f.fp, off) == 0 && (len == 0 || std::fread(dest[v], len * es, 1, f.fp) == 1);
+      continue;
+    }
+    // column i of the lower triangle holds sites i + 1 to m - 1; the part of
+    // it from the next site read to the last one is read at once
+    char* to = dest[v];
+    for(int64_t a = 0; a + 1 < k && ok; a++){
+      int64_t i = sub[a], j0 = sub[a + 1], cnt = sub[k - 1] - j0 + 1;
+      int64_t pos = i * (2 * m - i - 1) / 2 + (j0 - i - 1);
+      buf.resize(cnt * es);
+      ok = seek64(f.fp, off + pos * (int64_t)es) == 0 && std::fread(buf.data(), cnt * es, 1, f.fp) == 1;
+      for(int64_t b = a + 1; b < k && ok; b++, to += es){
+        std::memcpy(to, &buf[(sub[b] - j0) * es], es);
+      }
+    }
+  }
+  if(!ok) stop("The file " + path + " is truncated.");
+  out.attr("Size") = (double)k;
+  out.attr("single") = (bool)hdr.single;
+  return out;
+}
+
+// float32 values of a raw vector, as double
+// [[Rcpp::export]]
+NumericVector float_unpack_cpp(const RawVector& x){
+  const float* p = reinterpret_cast<const float*>(x.begin());
+  return NumericVector(p, p + x.size() / sizeof(float));
+}
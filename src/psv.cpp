@@ -1,5 +1,6 @@
 // we only include RcppArmadillo.h which pulls Rcpp.h in for us
 #include "RcppArmadillo.h"
+#include "psv.h"
 
 using namespace Rcpp;
 using namespace arma;
@@ -20,53 +21,133 @@ IntegerVector which2(const LogicalVector x){
   return xx;
 }
 
-// [[Rcpp::export]]
-arma::mat vcv_loop(NumericVector& xx, const int& n, const IntegerVector& e1, 
-                   const IntegerVector& e2, const NumericVector& EL, 
-                   const List& pp, bool corr //, const CharacterVector& sp
-  ){
-  arma::mat vcv(n, n, fill::zeros);
-  int len_e1 = e1.size();
-  for(int i = (len_e1 - 1); i > (-1); i--){
-    double var_cur_node = xx[e1[i] - 1];
-    xx[e2[i] - 1] = var_cur_node + EL[i];
-    int j = (i - 1);
-    while((e1[j] == e1[i]) && (j > (-1))){
-      IntegerVector left, right;
-      if(e2[j] > n){
-        left = pp[e2[j] - n - 1];
-      } else {
-        left = e2[j];
+// Phylogenetic var-cov matrix straight from ape's edge matrix, in tip-label
+// order. Tips are visited cladewise, so the tips below any node are one run of
+// `order`: for each child c of a node v, the tips of c share depth(v) with the
+// tips of v outside c, and each pair of tips is written once, by its most
+// recent common ancestor. Writes follow the tip numbers: only when tips are
+// numbered cladewise, as in most trees read by ape, is every run a contiguous
+// stretch of a column; with other numberings, writes within a column scatter.
+// With `packed`, only the upper triangle is written, packed by columns.
+template <typename T>
+static void vcv_tree_fill(const PhyloTree& tree, const bool& corr,
+                          const bool& packed, T* x){
+  int ntip = tree.ntip;
+  std::vector<double> a = tip_scale(tree, corr);
+  // cladewise tip order, and the run [lo, hi) of it below each node
+  std::vector<int> order;
+  order.reserve(ntip);
+  std::vector<int> lo(tree.nnode, ntip), hi(tree.nnode, 0);
+  for(int k = 0; k < tree.nnode; k++){
+    int v = tree.preorder[k];
+    if(v < ntip){
+      lo[v] = order.size();
+      hi[v] = lo[v] + 1;
+      order.push_back(v);
+    }
+  }
+  for(int k = tree.nnode - 1; k > 0; k--){
+    int v = tree.preorder[k], p = tree.parent[v];
+    lo[p] = std::min(lo[p], lo[v]);
+    hi[p] = std::max(hi[p], hi[v]);
+  }
+  
+  for(int k = 1; k < tree.nnode; k++){
+    int c = tree.preorder[k], v = tree.parent[c];
+    double h = tree.depth[v];
+    for(int s = lo[c]; s < hi[c]; s++){
+      int j = order[s];
+      double hj = h * a[j];
+      T* col = x + (packed ? packed_size(j) : (size_t)j * ntip);
+      for(int r = lo[v]; r < lo[c]; r++){
+        int i = order[r];
+        if(!packed || i < j) col[i] = hj * a[i];
       }
-      if(e2[i] > n){
-        right = pp[e2[i] - n - 1];
-      } else {
-        right = e2[i];
+      for(int r = hi[c]; r < hi[v]; r++){
+        int i = order[r];
+        if(!packed || i < j) col[i] = hj * a[i];
       }
-      left = left -1 ;
-      right = right - 1;
-      arma::uvec left2, right2;
-      left2 = as<arma::uvec>(left);
-      right2 = as<arma::uvec>(right);
-      vcv.submat(left2, right2).fill(var_cur_node);
-      vcv.submat(right2, left2).fill(var_cur_node);
-      j = j - 1;
-    }
-  }
-  arma::vec xx2 = as<arma::vec>(xx);
-  vcv.diag() = xx2.subvec(0, n - 1);
-  if(corr){
-    arma::vec Is = sqrt(1 / vcv.diag());
-    vcv.each_col() %= Is;
-    vcv.each_row() %= trans(Is);
-    vcv.diag().ones();
-  }
-  // NumericMatrix vcvv = wrap(vcv);
-  // rownames(vcvv) = sp;
-  // colnames(vcvv) = sp;
+    }
+  }
+  for(int t = 0; t < ntip; t++){
+    x[packed ? packed_size(t + 1) - 1 : (size_t)t * ntip + t] = corr ? 1.0 : tree.depth[t];
+  }
+}
+
+// [[Rcpp::export]]
+arma::mat vcv_tree_cpp(const IntegerVector& e1, const IntegerVector& e2,
+                       const NumericVector& EL, const int& ntip, const bool corr){
+  PhyloTree tree(e1.begin(), e2.begin(), EL.begin(), e1.size(), ntip);
+  arma::mat vcv(ntip, ntip); // every entry is written by vcv_tree_fill
+  vcv_tree_fill(tree, corr, false, vcv.memptr());
   return vcv;
 }
 
+// Packed upper triangle of the var-cov matrix, as doubles or, with `single`,
+// as float32 values in a raw vector; the full matrix is never allocated.
+// [[Rcpp::export]]
+SEXP vcv_tree_packed_cpp(const IntegerVector& e1, const IntegerVector& e2,
+                         const NumericVector& EL, const int& ntip, const bool corr,
+                         const bool single){
+  PhyloTree tree(e1.begin(), e2.begin(), EL.begin(), e1.size(), ntip);
+  if(single){
+    RawVector x(packed_size(ntip) * sizeof(float));
+    vcv_tree_fill(tree, corr, true, reinterpret_cast<float*>(x.begin()));
+    return x;
+  }
+  NumericVector x(packed_size(ntip));
+  vcv_tree_fill(tree, corr, true, x.begin());
+  return x;
+}
+
+// Rows and columns `idx` (1-based) of a packed_vcv, in the same storage
+// [[Rcpp::export]]
+SEXP packed_subset_cpp(SEXP Cmatrix, const IntegerVector& idx){
+  CovInput C(Cmatrix);
+  int k = idx.size();
+  for(int a = 0; a < k; a++){
+    if(idx[a] == NA_INTEGER || idx[a] < 1 || idx[a] > C.n) stop("Subscript out of bounds.");
+  }
+  if(C.kind == CovInput::PACKED_FLOAT){
+    PackedCov<float> P = C.packed_float();
+    RawVector x(packed_size(k) * sizeof(float));
+    float* out = reinterpret_cast<float*>(x.begin());
+    for(int b = 0; b < k; b++){
+      for(int a = 0; a <= b; a++) *out++ = P(idx[a] - 1, idx[b] - 1);
+    }
+    return x;
+  }
+  NumericVector x(packed_size(k));
+  double* out = x.begin();
+  for(int b = 0; b < k; b++){
+    for(int a = 0; a <= b; a++) *out++ = C(idx[a] - 1, idx[b] - 1);
+  }
+  return x;
+}
+
+// Full matrix from a packed_vcv
+// [[Rcpp::export]]
+NumericMatrix packed_unpack_cpp(SEXP Cmatrix){
+  CovInput C(Cmatrix);
+  NumericMatrix out(C.n, C.n);
+  for(int j = 0; j < C.n; j++){
+    for(int i = 0; i < C.n; i++) out(i, j) = C(i, j);
+  }
+  return out;
+}
+
+// Sum of all elements and trace of a var-cov matrix, in any storage
+// [[Rcpp::export]]
+NumericVector vcv_sums_cpp(SEXP Cmatrix){
+  CovInput C(Cmatrix);
+  double total = 0, tr = 0;
+  for(int j = 0; j < C.n; j++){
+    for(int i = 0; i < j; i++) total += 2 * C(i, j);
+    tr += C(j, j);
+  }
+  return NumericVector::create(total + tr, tr);
+}
+
 // [[Rcpp::export]]
 void cov2cor_cpp(arma::mat& vcv){
   arma::vec Is = sqrt(1 / vcv.diag());
@@ -76,120 +157,755 @@ void cov2cor_cpp(arma::mat& vcv){
   return ;
 }
 
+// Expected PSV variances from the var-cov matrix of the species pool, one per
+// site richness in SR (Helmus et al. 2007)
+template <typename Cov>
+static void psv_vars_cov(const Cov& C, const int& nspecies,
+                         const NumericVector& SR, NumericVector& PSVvar,
+                         const int& nthreads = 1){
+  double SS1, SS2;
+  psv_ss(C, nspecies, SS1, SS2, nthreads);
+  Rcpp::checkUserInterrupt();
+  psv_vars_from_ss(SS1, SS2, nspecies, SR, PSVvar);
+  return;
+}
+
+// Site loops below do not touch the R API, so they can run on several threads;
+// each site is computed the same way whatever the number of threads. Sites
+// repeating an earlier site (first[i] != i, see site_first_copy) are skipped
+// and get a copy of its results afterwards.
+template <typename Cov>
+static void pse_sites(const Cov& C, const SiteSets& sites, double* pses,
+                      const std::vector<int>& first, const int& nthreads){
+#pragma omp parallel for schedule(dynamic, 64) num_threads(n_threads(nthreads))
+  for(int i = 0; i < sites.nsite; ++i){
+    if(first[i] != i) continue;
+    int nsp = sites.richness(i);
+    if(nsp > 1){
+      pses[i] = pse_site(C, sites.species(i), sites.values(i), nsp, sites.total[i]);
+    } else {
+      pses[i] = NA_REAL;
+    }
+  }
+  for(int i = 0; i < sites.nsite; ++i) pses[i] = pses[first[i]];
+}
+
+template <typename Cov>
+static void psv_sites(const Cov& C, const SiteSets& sites, double* psvs,
+                      double* sr, const std::vector<int>& first, const int& nthreads){
+#pragma omp parallel for schedule(dynamic, 64) num_threads(n_threads(nthreads))
+  for(int i = 0; i < sites.nsite; ++i){
+    if(first[i] != i) continue;
+    int nsp = sites.richness(i);
+    if(nsp > 1){
+      psvs[i] = psv_site(C, sites.species(i), nsp);
+    } else {
+      psvs[i] = NA_REAL;
+    }
+  }
+  for(int i = 0; i < sites.nsite; ++i){
+    psvs[i] = psvs[first[i]];
+    sr[i] = sites.richness(i);
+  }
+}
+
+// Cmatrix is a numeric matrix or a packed_vcv (see vcv2)
 // [[Rcpp::export]]
-NumericVector pse_cpp(const NumericMatrix& comm, const arma::mat& Cmatrix){
-  int nlocations = comm.nrow();
-  // int nspecies = comm.ncol();
-  NumericVector PSEs(nlocations); // to hold results
-  // NumericVector SR(nlocations); // to hold results
+NumericVector pse_cpp(SEXP comm, SEXP Cmatrix, const int nthreads = 1){
+  SiteSets sites = as_site_sets(comm);
+  CovInput C(Cmatrix);
+  NumericVector PSEs(sites.nsite); // to hold results
+  std::vector<int> first = site_first_copy(sites, true);
+  Rcpp::checkUserInterrupt();
+  switch(C.kind){
+  case CovInput::PACKED: pse_sites(C.packed(), sites, PSEs.begin(), first, nthreads); break;
+  case CovInput::PACKED_FLOAT: pse_sites(C.packed_float(), sites, PSEs.begin(), first, nthreads); break;
+  default: pse_sites(C.dense(), sites, PSEs.begin(), first, nthreads);
+  }
+  return PSEs;
+}
+
+// [[Rcpp::export]]
+DataFrame psv_cpp(SEXP comm, 
+                  SEXP Cmatrix,
+                  const bool compute_var,
+                  const int nthreads = 1){
+  SiteSets sites = as_site_sets(comm);
+  int nlocations = sites.nsite;
+  int nspecies = sites.nsp;
+  CovInput C(Cmatrix);
+  NumericVector PSVs(nlocations); // to hold results
+  NumericVector SR(nlocations); // to hold results
+  std::vector<int> first = site_first_copy(sites, false);
+  switch(C.kind){
+  case CovInput::PACKED: 
+    psv_sites(C.packed(), sites, PSVs.begin(), SR.begin(), first, nthreads); break;
+  case CovInput::PACKED_FLOAT: 
+    psv_sites(C.packed_float(), sites, PSVs.begin(), SR.begin(), first, nthreads); break;
+  default: 
+    psv_sites(C.dense(), sites, PSVs.begin(), SR.begin(), first, nthreads);
+  }
+  
+  Rcpp::checkUserInterrupt();
+  
+  NumericVector PSVvar(nlocations);
+  if(compute_var && nspecies > 1){
+    switch(C.kind){
+    case CovInput::PACKED: psv_vars_cov(C.packed(), nspecies, SR, PSVvar, nthreads); break;
+    case CovInput::PACKED_FLOAT: psv_vars_cov(C.packed_float(), nspecies, SR, PSVvar, nthreads); break;
+    default: psv_vars_cov(C.dense(), nspecies, SR, PSVvar, nthreads);
+    }
+  }
+
+  return DataFrame::create(
+    _["PSVs"] = PSVs, 
+    _["SR"] = SR,
+    _["vars"] = PSVvar
+  );
+}
+
+// Per-site pieces of PSV: trace and sum of C over the site's species, and for
+// each species present its diagonal element and its row sum within the site
+// (one value per entry of `sites`).
+template <typename Cov>
+static void psv_site_sums(const Cov& C, const SiteSets& sites, double* tr,
+                          double* acc, double* dg, double* rs, const int& nthreads){
+#pragma omp parallel for schedule(dynamic, 64) num_threads(n_threads(nthreads))
+  for(int i = 0; i < sites.nsite; ++i){
+    int nsp = sites.richness(i);
+    const int* sp = sites.species(i);
+    size_t e0 = sites.ptr[i];
+    tr[i] = 0;
+    acc[i] = 0;
+    for(int a = 0; a < nsp; a++){
+      double r = 0;
+      for(int b = 0; b < nsp; b++) r += C(sp[a], sp[b]);
+      dg[e0 + a] = C(sp[a], sp[a]);
+      rs[e0 + a] = r;
+      tr[i] += dg[e0 + a];
+      acc[i] += r;
+    }
+  }
+}
+
+// Mean PSV across sites, and the mean PSV after removing each species in turn
+// (psv.spp). Removing species j from a site only takes C(j, j) from its trace
+// and 2 * (row sum of j) - C(j, j) from its sum, so all species come from one
+// pass over the sites instead of one psv() call per species.
+// [[Rcpp::export]]
+List psv_spp_cpp(SEXP comm, SEXP Cmatrix, const int nthreads = 1){
+  SiteSets sites = as_site_sets(comm);
+  int nlocations = sites.nsite;
+  int nspecies = sites.nsp;
+  CovInput C(Cmatrix);
+  size_t nnz = sites.ptr[nlocations];
+  std::vector<double> tr(nlocations), acc(nlocations), dg(nnz), rs(nnz);
+  switch(C.kind){
+  case CovInput::PACKED: 
+    psv_site_sums(C.packed(), sites, tr.data(), acc.data(), dg.data(), rs.data(), nthreads); break;
+  case CovInput::PACKED_FLOAT: 
+    psv_site_sums(C.packed_float(), sites, tr.data(), acc.data(), dg.data(), rs.data(), nthreads); break;
+  default: 
+    psv_site_sums(C.dense(), sites, tr.data(), acc.data(), dg.data(), rs.data(), nthreads);
+  }
+  Rcpp::checkUserInterrupt();
+  
+  // sums and counts of the sites' non-NA PSVs, without and with each species
+  double obs_sum = 0;
+  int obs_cnt = 0;
+  std::vector<double> psvs(nlocations, NA_REAL);
   for(int i = 0; i < nlocations; ++i){
+    double n = sites.richness(i);
+    if(n > 1){
+      psvs[i] = (n * tr[i] - acc[i]) / (n * (n - 1));
+      obs_sum += psvs[i];
+      obs_cnt++;
+    }
+  }
+  std::vector<double> spp_sum(nspecies, obs_sum);
+  std::vector<int> spp_cnt(nspecies, obs_cnt);
+  for(int i = 0; i < nlocations; ++i){
+    double n = sites.richness(i) - 1;
+    if(n < 1) continue;
+    const int* sp = sites.species(i);
+    size_t e0 = sites.ptr[i];
+    for(int a = 0; a <= n; a++){
+      int j = sp[a];
+      spp_sum[j] -= psvs[i];
+      spp_cnt[j]--;
+      if(n > 1){
+        double tr_j = tr[i] - dg[e0 + a];
+        double acc_j = acc[i] - 2 * rs[e0 + a] + dg[e0 + a];
+        spp_sum[j] += (n * tr_j - acc_j) / (n * (n - 1));
+        spp_cnt[j]++;
+      }
+    }
+  }
+  
+  NumericVector spp(nspecies);
+  for(int j = 0; j < nspecies; j++){
+    spp[j] = spp_cnt[j] > 0 ? spp_sum[j] / spp_cnt[j] : R_NaN;
+  }
+  return List::create(
+    _["obs"] = obs_cnt > 0 ? obs_sum / obs_cnt : R_NaN,
+    _["spp"] = spp
+  );
+}
+
+// Batched PSV and PSE: with M the site x species matrix, m'Cm for every site is
+// the row sums of (M C) % M and diag(C)'m is M diag(C), so a block of sites
+// costs one matrix product (BLAS for dense comm, sparse-dense for sparse comm)
+// instead of one small submatrix per site. `pa` uses presences instead of the
+// values in comm. Fills d (diag(C)'m) and q (m'Cm) for each site.
+static void site_quad_forms(const SiteSets& sites, const bool& sparse,
+                            const arma::mat& Cmatrix, const bool& pa,
+                            const int& block, arma::vec& d, arma::vec& q){
+  int nlocations = sites.nsite;
+  int nspecies = sites.nsp;
+  int nb_max = block > 0 ? block : nlocations;
+  arma::vec cd = Cmatrix.diag();
+  d.zeros(nlocations);
+  q.zeros(nlocations);
+  for(int i0 = 0; i0 < nlocations; i0 += nb_max){
+    int nb = std::min(nb_max, nlocations - i0);
+    if(sparse){
+      size_t e0 = sites.ptr[i0], ne = sites.ptr[i0 + nb] - e0;
+      arma::umat loc(2, ne);
+      arma::vec x(ne);
+      for(int r = 0; r < nb; r++){
+        for(size_t e = sites.ptr[i0 + r]; e < sites.ptr[i0 + r + 1]; e++){
+          loc(0, e - e0) = r;
+          loc(1, e - e0) = sites.idx[e];
+          x(e - e0) = pa ? 1.0 : sites.val[e];
+        }
+      }
+      arma::sp_mat Mb(loc, x, nb, nspecies);
+      arma::mat P = Mb * Cmatrix;
+      d.subvec(i0, i0 + nb - 1) = Mb * cd;
+      for(int r = 0; r < nb; r++){
+        double acc = 0;
+        for(size_t e = sites.ptr[i0 + r]; e < sites.ptr[i0 + r + 1]; e++){
+          acc += x(e - e0) * P(r, sites.idx[e]);
+        }
+        q(i0 + r) = acc;
+      }
+    } else {
+      arma::mat Mb(nb, nspecies, fill::zeros);
+      for(int r = 0; r < nb; r++){
+        for(size_t e = sites.ptr[i0 + r]; e < sites.ptr[i0 + r + 1]; e++){
+          Mb(r, sites.idx[e]) = pa ? 1.0 : sites.val[e];
+        }
+      }
+      arma::mat P = Mb * Cmatrix;
+      d.subvec(i0, i0 + nb - 1) = Mb * cd;
+      q.subvec(i0, i0 + nb - 1) = sum(P % Mb, 1);
+    }
     Rcpp::checkUserInterrupt();
-    LogicalVector index = (comm.row(i) > 0);
-    IntegerVector iindex = which2(index);
-    int nsp = sum(index);
-    double pse;
+  }
+}
+
+// [[Rcpp::export]]
+DataFrame psv_batch_cpp(SEXP comm, const arma::mat& Cmatrix,
+                        const bool compute_var, const int block = 256){
+  SiteSets sites = as_site_sets(comm);
+  int nlocations = sites.nsite;
+  int nspecies = sites.nsp;
+  arma::vec d, q;
+  site_quad_forms(sites, Rf_isS4(comm), Cmatrix, true, block, d, q);
+  NumericVector PSVs(nlocations); // to hold results
+  NumericVector SR(nlocations); // to hold results
+  for(int i = 0; i < nlocations; ++i){
+    int nsp = sites.richness(i);
     if(nsp > 1){
-      arma::uvec iindex_arma = as<arma::uvec>(iindex);
-      arma::mat C = Cmatrix.submat(iindex_arma, iindex_arma);
-      NumericVector M0 = comm(i, _);
-      double N = sum(M0);
-      NumericVector M1 = M0[iindex];
-      arma::colvec M = as<arma::colvec>(M1);
-      double mbar = mean(M1);
-      double dem = pow(N, 2) - N * mbar;
-      double num = as_scalar(N * trans(C.diag()) * M - trans(M) * C * M);
-      pse = (num / dem);
-      // Rcout << pse << " ";
+      PSVs[i] = (nsp * d(i) - q(i)) / (nsp * (nsp - 1));
     } else {
-      pse = NA_REAL;
+      PSVs[i] = NA_REAL;
+    }
+    SR[i] = nsp;
+  }
+  
+  NumericVector PSVvar(nlocations);
+  if(compute_var && nspecies > 1){
+    psv_vars_cov(DenseCov(Cmatrix.memptr(), nspecies), nspecies, SR, PSVvar);
+  }
+
+  return DataFrame::create(
+    _["PSVs"] = PSVs, 
+    _["SR"] = SR,
+    _["vars"] = PSVvar
+  );
+}
+
+// [[Rcpp::export]]
+NumericVector pse_batch_cpp(SEXP comm, const arma::mat& Cmatrix,
+                            const int block = 256){
+  SiteSets sites = as_site_sets(comm);
+  int nlocations = sites.nsite;
+  arma::vec d, q;
+  site_quad_forms(sites, Rf_isS4(comm), Cmatrix, false, block, d, q);
+  NumericVector PSEs(nlocations); // to hold results
+  for(int i = 0; i < nlocations; ++i){
+    int nsp = sites.richness(i);
+    if(nsp > 1){
+      const double* M = sites.values(i);
+      double msum = 0;
+      for(int a = 0; a < nsp; a++) msum += M[a];
+      double N = sites.total[i];
+      double mbar = msum / nsp;
+      PSEs[i] = (N * d(i) - q(i)) / (N * N - N * mbar);
+    } else {
+      PSEs[i] = NA_REAL;
     }
-    PSEs[i] = pse;
   }
   return PSEs;
 }
 
+// Expected PSV variances from the tree: the same quantities as psv_vars_cov,
+// but from (pairwise) tree sums, as C[k, l] = a_k * a_l * depth(mrca(k, l)) off
+// the diagonal. `tips` gives the tip (1-based) of each species.
+static void psv_vars_tree(const PhyloTree& tree, const std::vector<double>& a,
+                          const IntegerVector& tips, const bool& corr,
+                          const NumericVector& SR, NumericVector& PSVvar){
+  int nspecies = tips.size();
+  std::vector<int> tk(nspecies);
+  for(int k = 0; k < nspecies; k++) tk[k] = tips[k] - 1;
+  std::vector<double> W(tree.nnode, 0.0), B(tree.nnode, 0.0), B2(tree.nnode, 0.0);
+  double trc = 0;
+  for(int k = 0; k < nspecies; k++){
+    W[tk[k]] = a[tk[k]];
+    B[tk[k]] = a[tk[k]] * a[tk[k]];
+    trc += corr ? 1.0 : tree.depth[tk[k]];
+  }
+  double sumc = 0; // accu(Cmatrix)
+  for(int q = tree.nnode - 1; q > 0; q--){
+    int v = tree.preorder[q];
+    int p = tree.parent[v];
+    sumc += tree.brlen[v] * W[v] * W[v];
+    W[p] += W[v];
+    B[p] += B[v];
+    B2[p] += B[v] * B[v];
+  }
+  double sumc2 = 0; // sum of squared off-diagonal covariances
+  for(int v = tree.ntip; v < tree.nnode; v++){
+    sumc2 += tree.depth[v] * tree.depth[v] * (B[v] * B[v] - B2[v]);
+  }
+  // row sums of Cmatrix, top-down
+  std::vector<double> P(tree.nnode, 0.0);
+  for(int q = 1; q < tree.nnode; q++){
+    int v = tree.preorder[q];
+    P[v] = P[tree.parent[v]] + tree.brlen[v] * W[v];
+  }
+  double ns = nspecies;
+  double cbar = (sumc - ns) / (ns * (ns - 1));
+  double SS1 = (sumc2 - 2 * cbar * (sumc - trc) + ns * (ns - 1) * cbar * cbar) / 2;
+  // sum over k < l of X[k, l] * rowSums(X)[k], inserting species from the
+  // last column backwards so that acc holds only the species with l > k
+  std::vector<double> acc(tree.nnode, 0.0);
+  double xr = 0;
+  for(int k = nspecies - 1; k >= 0; k--){
+    int t = tk[k];
+    double u = 0;
+    for(int v = t; v != tree.root; v = tree.parent[v]){
+      u += tree.brlen[v] * acc[v];
+      acc[v] += a[t];
+    }
+    u *= a[t];
+    double ckk = corr ? 1.0 : tree.depth[t];
+    double rk = (a[t] * P[t] - ckk) - (ns - 1) * cbar;
+    xr += rk * (u - (ns - 1 - k) * cbar);
+  }
+  double SS2 = xr - SS1;
+  psv_vars_from_ss(SS1, SS2, nspecies, SR, PSVvar);
+  return;
+}
+
+// PSV from the phylogeny itself: for the species present at a site, the sum
+// of their covariances is the sum over edges of (branch length) * (number of
+// present tips below the edge)^2, so the covariance matrix is never built.
 // [[Rcpp::export]]
-DataFrame psv_cpp(const NumericMatrix& comm, 
-                  const arma::mat& Cmatrix,
-                  const bool compute_var){
-  int nlocations = comm.nrow();
-  int nspecies = comm.ncol();
+DataFrame psv_tree_cpp(SEXP comm, const IntegerVector& tips,
+                       const IntegerVector& e1, const IntegerVector& e2,
+                       const NumericVector& EL, const int& ntip,
+                       const bool corr, const bool compute_var,
+                       const int nthreads = 1){
+  SiteSets sites = as_site_sets(comm);
+  int nlocations = sites.nsite;
+  int nspecies = sites.nsp;
+  PhyloTree tree(e1.begin(), e2.begin(), EL.begin(), e1.size(), ntip);
+  std::vector<double> a = tip_scale(tree, corr);
+  const int* tp = tips.begin();
   NumericVector PSVs(nlocations); // to hold results
   NumericVector SR(nlocations); // to hold results
+  double* psvs = PSVs.begin();
+  double* sr = SR.begin();
+#pragma omp parallel num_threads(n_threads(nthreads))
+{
+  std::vector<double> w(tree.nnode, 0.0);
+#pragma omp for schedule(dynamic, 16)
   for(int i = 0; i < nlocations; ++i){
-    LogicalVector index = (comm.row(i) > 0);
-    IntegerVector iindex = which2(index);
-    int nsp = sum(index);
-    double psv;
+    int nsp = sites.richness(i);
+    const int* sp = sites.species(i);
+    double tr = 0;
+    for(int k = 0; k < nsp; k++){
+      int t = tp[sp[k]] - 1;
+      w[t] = a[t];
+      tr += corr ? 1.0 : tree.depth[t];
+    }
     if(nsp > 1){
-      arma::uvec iindex_arma = as<arma::uvec>(iindex);
-      arma::mat cm = Cmatrix.submat(iindex_arma, iindex_arma);
-      psv = (nsp * trace(cm) - accu(cm)) / (nsp * (nsp - 1));
+      double sumc = tree_quad_form(tree, w);
+      psvs[i] = (nsp * tr - sumc) / (nsp * (nsp - 1));
     } else {
-      psv = NA_REAL;
+      psvs[i] = NA_REAL;
     }
-    PSVs[i] = psv;
-    SR[i] = nsp;
+    std::fill(w.begin(), w.end(), 0.0);
+    sr[i] = nsp;
   }
+}
   
   Rcpp::checkUserInterrupt();
   
   NumericVector PSVvar(nlocations);
   if(compute_var && nspecies > 1){
-    arma::mat cdig = mat(nspecies, nspecies);
-    cdig.eye();
-    arma::mat X = Cmatrix - (accu(Cmatrix - cdig))/(nspecies * (nspecies - 1));
-    X.diag().zeros();
-    double SS1 = accu(X % X) / 2;
-    // Rcout << "SS1 = " << SS1 << endl;
-    NumericMatrix ss2(nspecies);
-    for(int i = 0; i < (nspecies - 1); i++){
-      double sumi = sum(X.row(i));
-      for(int j = i + 1; j < nspecies; j++){
-        ss2(i, j) = X(i, j) * (sumi - X(i, j));
-      }
+    psv_vars_tree(tree, a, tips, corr, SR, PSVvar);
+  }
+  
+  return DataFrame::create(
+    _["PSVs"] = PSVs, 
+    _["SR"] = SR,
+    _["vars"] = PSVvar
+  );
+}
+
+// PSE from the phylogeny, weighting each present tip by its abundance.
+// [[Rcpp::export]]
+NumericVector pse_tree_cpp(SEXP comm, const IntegerVector& tips,
+                           const IntegerVector& e1, const IntegerVector& e2,
+                           const NumericVector& EL, const int& ntip,
+                           const bool corr, const int nthreads = 1){
+  SiteSets sites = as_site_sets(comm);
+  int nlocations = sites.nsite;
+  PhyloTree tree(e1.begin(), e2.begin(), EL.begin(), e1.size(), ntip);
+  std::vector<double> a = tip_scale(tree, corr);
+  const int* tp = tips.begin();
+  NumericVector PSEs(nlocations); // to hold results
+  double* pses = PSEs.begin();
+  Rcpp::checkUserInterrupt();
+#pragma omp parallel num_threads(n_threads(nthreads))
+{
+  std::vector<double> w(tree.nnode, 0.0);
+#pragma omp for schedule(dynamic, 16)
+  for(int i = 0; i < nlocations; ++i){
+    int nsp = sites.richness(i);
+    const int* sp = sites.species(i);
+    const double* M = sites.values(i);
+    double msum = 0, dm = 0;
+    for(int k = 0; k < nsp; k++){
+      int t = tp[sp[k]] - 1;
+      w[t] = M[k] * a[t];
+      dm += M[k] * (corr ? 1.0 : tree.depth[t]);
+      msum += M[k];
     }
-    double SS2 = sum(ss2);
-    double SS3 = (-1 * SS1) - SS2;
-    // Rcout << "SS2 = " << SS2 << endl;
-    // Rcout << "SS3 = " << SS3 << endl;
-    // Rcout << "nspecies * (nspecies - 1) = " << nspecies * (nspecies - 1) << endl;
-    // Rcout << "(nspecies * (nspecies - 1) * (nspecies - 2)) = " << double(nspecies * (nspecies - 1) * (nspecies - 2)) << endl;
-    double S1 = SS1 * 2.0/(nspecies * (nspecies - 1.0));
-    double S2 = SS2 * 2.0/(nspecies * (nspecies - 1.0) * (nspecies - 2.0)); // 1.0 not 1 !!
-    double S3;
-    if (nspecies == 3) {
-      S3 = 0;
+    if(nsp > 1){
+      double N = sites.total[i];
+      double mcm = tree_quad_form(tree, w);
+      double mbar = msum / nsp;
+      double dem = N * N - N * mbar;
+      pses[i] = (N * dm - mcm) / dem;
     } else {
-      S3 = SS3 * 2.0/(nspecies * (nspecies - 1.0) * (nspecies - 2.0) * (nspecies - 3.0));
+      pses[i] = NA_REAL;
     }
-    // Rcout << "S1 = " << S1 << endl;
-    // Rcout << "S2 = " << S2 << endl;
-    // Rcout << "S3 = " << S3 << endl;
-    // Rcout << "nsp = " << nspecies << endl;
-    Rcpp::checkUserInterrupt();
-    NumericVector PSVary(nspecies - 1);
-    for (int ni = 1; ni < (nspecies - 1); ni++) {
-      double nii = ni + 1; // need to be double, not int
-      PSVary[ni - 1] = 2.0/(nii * (nii - 1)) * (S1 + (nii - 2) * S2 + (nii - 2) * (nii - 3) * S3);
-    }
-    
-    for(int g = 0; g < nlocations; g++){
-      if(SR[g] > 1){
-        PSVvar[g] = PSVary[(SR[g] - 2)];
-      } else {
-        PSVvar[g] = NA_REAL;
-      }
+    std::fill(w.begin(), w.end(), 0.0);
+  }
+}
+  return PSEs;
+}
+
+// Scratch space for psc_site_tree, reused across the sites of one thread.
+struct PscWork {
+  std::vector<int> node;     // virtual tree: site tips and their pairwise LCAs
+  std::vector<int> vparent;  // parent of each virtual node, -1 for its root
+  std::vector<int> stack;
+  std::vector<int> child1;   // child holding the largest tip weight below
+  std::vector<double> m1, m2;  // largest and second largest tip weight below,
+                               // over different children
+};
+
+// PSC of one site from the tree. C[i, j] = depth(lca(i, j)) * a_i * a_j, so the
+// nearest relative of tip i is found by walking up the site's virtual tree
+// (its tips and their pairwise LCAs, built from the tips in preorder): at each
+// ancestor u, the best partner is the largest a_j below u but not below the
+// child towards i. Depths only decrease going up, so the walk stops as soon
+// as depth(u) times the largest a_j of the site cannot beat the best so far.
+static double psc_site_tree(const PhyloTree& tree, const TreeLCA& lca,
+                            const std::vector<double>& a, int* tips,
+                            const int& nsp, PscWork& w){
+  std::sort(tips, tips + nsp, [&lca](int u, int v){ return lca.pre[u] < lca.pre[v]; });
+  w.node.assign(tips, tips + nsp);
+  for(int k = 0; k + 1 < nsp; k++) w.node.push_back(lca.lca(tips[k], tips[k + 1]));
+  std::sort(w.node.begin(), w.node.end(), [&lca](int u, int v){ return lca.pre[u] < lca.pre[v]; });
+  w.node.erase(std::unique(w.node.begin(), w.node.end()), w.node.end());
+  int nv = w.node.size();
+  
+  // parents from a stack of the current path; nodes are in preorder
+  w.vparent.assign(nv, -1);
+  w.stack.clear();
+  for(int x = 0; x < nv; x++){
+    while(!w.stack.empty() && !lca.is_ancestor(w.node[w.stack.back()], w.node[x])){
+      w.stack.pop_back();
+    }
+    if(!w.stack.empty()) w.vparent[x] = w.stack.back();
+    w.stack.push_back(x);
+  }
+  
+  // largest tip weights below each node, over its two best children
+  w.child1.assign(nv, -1);
+  w.m1.assign(nv, -1.0);
+  w.m2.assign(nv, -1.0);
+  for(int x = nv - 1; x >= 0; x--){
+    if(w.node[x] < tree.ntip) w.m1[x] = a[w.node[x]];
+    int p = w.vparent[x];
+    if(p < 0) continue;
+    if(w.m1[x] > w.m1[p]){
+      w.m2[p] = w.m1[p];
+      w.m1[p] = w.m1[x];
+      w.child1[p] = x;
+    } else if(w.m1[x] > w.m2[p]){
+      w.m2[p] = w.m1[x];
+    }
+  }
+  double amax = w.m1[0];
+  
+  double acc = 0;
+  for(int x = 0; x < nv; x++){
+    int t = w.node[x];
+    if(t >= tree.ntip) continue;
+    double best = -1;
+    for(int c = x, u = w.vparent[x]; u >= 0; c = u, u = w.vparent[u]){
+      double h = tree.depth[w.node[u]];
+      if(h * amax <= best) break;
+      double other = w.child1[u] == c ? w.m2[u] : w.m1[u];
+      best = std::max(best, h * other);
+    }
+    acc += best * a[t];
+  }
+  return 1 - acc / nsp;
+}
+
+// PSC from the phylogeny, without the var-cov matrix
+// [[Rcpp::export]]
+NumericVector psc_tree_cpp(SEXP comm, const IntegerVector& tips,
+                           const IntegerVector& e1, const IntegerVector& e2,
+                           const NumericVector& EL, const int& ntip,
+                           const bool corr, const int nthreads = 1){
+  SiteSets sites = as_site_sets(comm);
+  int nlocations = sites.nsite;
+  PhyloTree tree(e1.begin(), e2.begin(), EL.begin(), e1.size(), ntip);
+  TreeLCA lca(tree);
+  std::vector<double> a = tip_scale(tree, corr);
+  const int* tp = tips.begin();
+  NumericVector PSCs(nlocations); // to hold results
+  double* pscs = PSCs.begin();
+#pragma omp parallel num_threads(n_threads(nthreads))
+{
+  PscWork work;
+  std::vector<int> st;
+#pragma omp for schedule(dynamic, 16)
+  for(int i = 0; i < nlocations; ++i){
+    int nsp = sites.richness(i);
+    if(nsp > 1){
+      const int* sp = sites.species(i);
+      st.resize(nsp);
+      for(int k = 0; k < nsp; k++) st[k] = tp[sp[k]] - 1;
+      pscs[i] = psc_site_tree(tree, lca, a, &st[0], nsp, work);
+    } else {
+      pscs[i] = NA_REAL;
+    }
+  }
+}
+  return PSCs;
+}
+
+template <typename Cov>
+static void psc_sites(const Cov& C, const SiteSets& sites, double* pscs,
+                      const int& nthreads){
+#pragma omp parallel for schedule(dynamic, 64) num_threads(n_threads(nthreads))
+  for(int i = 0; i < sites.nsite; ++i){
+    int nsp = sites.richness(i);
+    if(nsp > 1){
+      pscs[i] = psc_site(C, sites.species(i), nsp);
+    } else {
+      pscs[i] = NA_REAL;
+    }
+  }
+}
+
+// PSC from the var-cov matrix, for when the phylogeny itself is not available
+// [[Rcpp::export]]
+NumericVector psc_cpp(SEXP comm, SEXP Cmatrix, const int nthreads = 1){
+  SiteSets sites = as_site_sets(comm);
+  CovInput C(Cmatrix);
+  NumericVector PSCs(sites.nsite); // to hold results
+  switch(C.kind){
+  case CovInput::PACKED: psc_sites(C.packed(), sites, PSCs.begin(), nthreads); break;
+  case CovInput::PACKED_FLOAT: psc_sites(C.packed_float(), sites, PSCs.begin(), nthreads); break;
+  default: psc_sites(C.dense(), sites, PSCs.begin(), nthreads);
+  }
+  return PSCs;
+}
+
+/*
+ * psd: PSV, PSC, PSR and PSE together, from one pass over the sites; psd() in R
+ * gets the same values as from psv, psc, psr and pse one after another.
+ */
+
+template <typename Cov>
+static void psd_sites(const Cov& C, const SiteSets& sites, double* psvs,
+                      double* pscs, double* pses, const std::vector<int>& first,
+                      const int& nthreads){
+#pragma omp parallel for schedule(dynamic, 64) num_threads(n_threads(nthreads))
+  for(int i = 0; i < sites.nsite; ++i){
+    if(first[i] != i) continue;
+    int nsp = sites.richness(i);
+    if(nsp > 1){
+      psd_site(C, sites.species(i), sites.values(i), nsp, sites.total[i],
+               psvs[i], pscs[i], pses[i]);
+    } else {
+      psvs[i] = NA_REAL;
+      pscs[i] = NA_REAL;
+      pses[i] = NA_REAL;
     }
   }
+  for(int i = 0; i < sites.nsite; ++i){
+    psvs[i] = psvs[first[i]];
+    pscs[i] = pscs[first[i]];
+    pses[i] = pses[first[i]];
+  }
+}
 
+// columns of psd(): PSR and its variance follow from PSV and SR
+static DataFrame psd_frame(const SiteSets& sites, const NumericVector& PSVs,
+                           const NumericVector& PSVvar, const NumericVector& PSCs,
+                           const NumericVector& PSEs){
+  int nlocations = sites.nsite;
+  NumericVector SR(nlocations), PSR(nlocations), PSRvar(nlocations);
+  for(int i = 0; i < nlocations; ++i){
+    SR[i] = sites.richness(i);
+    PSR[i] = PSVs[i] * SR[i];
+    PSRvar[i] = PSVvar[i] * (SR[i] * SR[i]);
+  }
   return DataFrame::create(
-    _["PSVs"] = PSVs, 
-    _["SR"] = SR,
-    _["vars"] = PSVvar
+    _["PSVs"] = PSVs,
+    _["PSVvars"] = PSVvar,
+    _["PSCs"] = PSCs,
+    _["PSR"] = PSR,
+    _["PSRvars"] = PSRvar,
+    _["PSEs"] = PSEs,
+    _["SR"] = SR
   );
 }
 
+// `comm` holds abundances (presences for PSV, PSC and PSR)
+// [[Rcpp::export]]
+DataFrame psd_cpp(SEXP comm, SEXP Cmatrix, const bool compute_var,
+                  const int nthreads = 1){
+  SiteSets sites = as_site_sets(comm);
+  int nlocations = sites.nsite;
+  int nspecies = sites.nsp;
+  CovInput C(Cmatrix);
+  NumericVector PSVs(nlocations), PSCs(nlocations), PSEs(nlocations);
+  std::vector<int> first = site_first_copy(sites, true);
+  switch(C.kind){
+  case CovInput::PACKED: 
+    psd_sites(C.packed(), sites, PSVs.begin(), PSCs.begin(), PSEs.begin(), first, nthreads); break;
+  case CovInput::PACKED_FLOAT: 
+    psd_sites(C.packed_float(), sites, PSVs.begin(), PSCs.begin(), PSEs.begin(), first, nthreads); break;
+  default: 
+    psd_sites(C.dense(), sites, PSVs.begin(), PSCs.begin(), PSEs.begin(), first, nthreads);
+  }
+  Rcpp::checkUserInterrupt();
+  
+  NumericVector PSVvar(nlocations);
+  if(compute_var && nspecies > 1){
+    NumericVector SR(nlocations);
+    for(int i = 0; i < nlocations; ++i) SR[i] = sites.richness(i);
+    switch(C.kind){
+    case CovInput::PACKED: psv_vars_cov(C.packed(), nspecies, SR, PSVvar, nthreads); break;
+    case CovInput::PACKED_FLOAT: psv_vars_cov(C.packed_float(), nspecies, SR, PSVvar, nthreads); break;
+    default: psv_vars_cov(C.dense(), nspecies, SR, PSVvar, nthreads);
+    }
+  }
+  return psd_frame(sites, PSVs, PSVvar, PSCs, PSEs);
+}
+
+// psd from the phylogeny: two weighted tree sums (presences and abundances)
+// and the virtual tree of each site
+// [[Rcpp::export]]
+DataFrame psd_tree_cpp(SEXP comm, const IntegerVector& tips,
+                       const IntegerVector& e1, const IntegerVector& e2,
+                       const NumericVector& EL, const int& ntip,
+                       const bool corr, const bool compute_var,
+                       const int nthreads = 1){
+  SiteSets sites = as_site_sets(comm);
+  int nlocations = sites.nsite;
+  int nspecies = sites.nsp;
+  PhyloTree tree(e1.begin(), e2.begin(), EL.begin(), e1.size(), ntip);
+  TreeLCA lca(tree);
+  std::vector<double> a = tip_scale(tree, corr);
+  const int* tp = tips.begin();
+  NumericVector PSVs(nlocations), PSCs(nlocations), PSEs(nlocations);
+  double* psvs = PSVs.begin();
+  double* pscs = PSCs.begin();
+  double* pses = PSEs.begin();
+#pragma omp parallel num_threads(n_threads(nthreads))
+{
+  std::vector<double> w(tree.nnode, 0.0), wm(tree.nnode, 0.0);
+  std::vector<int> st;
+  PscWork work;
+#pragma omp for schedule(dynamic, 16)
+  for(int i = 0; i < nlocations; ++i){
+    int nsp = sites.richness(i);
+    if(nsp > 1){
+      const int* sp = sites.species(i);
+      const double* M = sites.values(i);
+      st.resize(nsp);
+      double tr = 0, dm = 0, msum = 0;
+      for(int k = 0; k < nsp; k++){
+        int t = tp[sp[k]] - 1;
+        st[k] = t;
+        w[t] = a[t];
+        wm[t] = M[k] * a[t];
+        double ctt = corr ? 1.0 : tree.depth[t];
+        tr += ctt;
+        dm += M[k] * ctt;
+        msum += M[k];
+      }
+      double sumc = tree_quad_form(tree, w);
+      psvs[i] = (nsp * tr - sumc) / (nsp * (nsp - 1));
+      double N = sites.total[i];
+      double mcm = tree_quad_form(tree, wm);
+      double mbar = msum / nsp;
+      pses[i] = (N * dm - mcm) / (N * N - N * mbar);
+      pscs[i] = psc_site_tree(tree, lca, a, &st[0], nsp, work);
+      std::fill(w.begin(), w.end(), 0.0);
+      std::fill(wm.begin(), wm.end(), 0.0);
+    } else {
+      psvs[i] = NA_REAL;
+      pscs[i] = NA_REAL;
+      pses[i] = NA_REAL;
+    }
+  }
+}
+  Rcpp::checkUserInterrupt();
+  
+  NumericVector PSVvar(nlocations);
+  if(compute_var && nspecies > 1){
+    NumericVector SR(nlocations);
+    for(int i = 0; i < nlocations; ++i) SR[i] = sites.richness(i);
+    psv_vars_tree(tree, a, tips, corr, SR, PSVvar);
+  }
+  return psd_frame(sites, PSVs, PSVvar, PSCs, PSEs);
+}
+
 /*** R
 # nspp = 20
 # nsite = 30
@@ -204,4 +920,4 @@ DataFrame psv_cpp(const NumericMatrix& comm,
 # psv_cpp(comm_sim, cmx, F)
 # tst = psv_cpp(comm, Cmatrix, T)
 # psv_cpp(comm, Cmatrix, T)
-*/
\ No newline at end of file
+*/
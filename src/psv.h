@@ -0,0 +1,786 @@
+// -*- mode: C++; c-indent-level: 4; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#ifndef __PHYR_PSV_H
+#define __PHYR_PSV_H
+
+#include <RcppArmadillo.h>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+#include <stdint.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+
+/*
+ ***************************************************************************************
+ ***************************************************************************************
+
+ Phylogeny helpers
+
+ Everything in here works on plain arrays so that it can be used from worker
+ threads without touching the R API.
+
+ ***************************************************************************************
+ ***************************************************************************************
+ */
+
+
+// A rooted phylogeny stored as parent pointers, built from ape's edge matrix.
+// Nodes are 0-based: tips are 0..(ntip - 1), the root is ntip (as in ape).
+class PhyloTree {
+public:
+  int ntip;
+  int nnode;                  // tips + internal nodes
+  int root;
+  std::vector<int> parent;    // parent of each node, -1 for the root
+  std::vector<double> brlen;  // length of the edge leading to each node
+  std::vector<double> depth;  // root-to-node distance
+  std::vector<int> preorder;  // nodes in preorder, children in edge-matrix order
+
+  PhyloTree(const int* e1, const int* e2, const double* el,
+            const int& n_edge, const int& ntip_)
+    : ntip(ntip_), nnode(n_edge + 1), root(ntip_),
+      parent(n_edge + 1, -1), brlen(n_edge + 1, 0.0),
+      depth(n_edge + 1, 0.0), preorder() {
+
+    // children stored as CSR, keeping the order in which edges are listed
+    std::vector<int> child_ptr(nnode + 1, 0);
+    for (int e = 0; e < n_edge; e++) child_ptr[e1[e]]++;
+    for (int v = 0; v < nnode; v++) child_ptr[v + 1] += child_ptr[v];
+    std::vector<int> child_idx(n_edge);
+    std::vector<int> pos(child_ptr.begin(), child_ptr.end() - 1);
+    for (int e = 0; e < n_edge; e++) {
+      int p = e1[e] - 1, c = e2[e] - 1;
+      parent[c] = p;
+      brlen[c] = el[e];
+      child_idx[pos[p]++] = c;
+    }
+
+    preorder.reserve(nnode);
+    std::vector<int> stack;
+    stack.push_back(root);
+    while (!stack.empty()) {
+      int v = stack.back();
+      stack.pop_back();
+      preorder.push_back(v);
+      if (v != root) depth[v] = depth[parent[v]] + brlen[v];
+      for (int k = child_ptr[v + 1] - 1; k >= child_ptr[v]; k--) {
+        stack.push_back(child_idx[k]);
+      }
+    }
+  }
+};
+
+
+// Per-tip weights that turn the tree's covariance into the matrix `vcv2` would
+// return: 1 for raw covariances, 1 / sqrt(root-to-tip distance) for correlations.
+inline std::vector<double> tip_scale(const PhyloTree& tree, const bool& corr) {
+  std::vector<double> a(tree.ntip, 1.0);
+  if (corr) {
+    for (int t = 0; t < tree.ntip; t++) a[t] = std::sqrt(1 / tree.depth[t]);
+  }
+  return a;
+}
+
+
+// Weighted quadratic form w' C w for the tree's covariance matrix C, where `w`
+// holds one weight per node (tips only; internal entries must be zero on entry).
+// `w` is used as scratch space and comes back holding subtree sums.
+inline double tree_quad_form(const PhyloTree& tree, std::vector<double>& w) {
+  double out = 0;
+  for (int k = tree.nnode - 1; k > 0; k--) {
+    int v = tree.preorder[k];
+    out += tree.brlen[v] * w[v] * w[v];
+    w[tree.parent[v]] += w[v];
+  }
+  return out;
+}
+
+// Lowest common ancestors in constant time after an O(n log n) set-up: for
+// nodes u != v with u first in preorder, the LCA is the parent of the
+// shallowest node among preorder positions pre(u) + 1 .. pre(v).
+class TreeLCA {
+public:
+  std::vector<int> pre;   // preorder position of each node
+  std::vector<int> size;  // number of nodes in each subtree
+
+  TreeLCA(const PhyloTree& tree_)
+    : pre(tree_.nnode), size(tree_.nnode, 1), tree(tree_),
+      level(tree_.nnode, 0), lg(tree_.nnode + 1, 0), table() {
+    int n = tree.nnode;
+    for (int q = 0; q < n; q++) {
+      int v = tree.preorder[q];
+      pre[v] = q;
+      if (v != tree.root) level[v] = level[tree.parent[v]] + 1;
+    }
+    for (int q = n - 1; q > 0; q--) {
+      int v = tree.preorder[q];
+      size[tree.parent[v]] += size[v];
+    }
+    for (int len = 2; len <= n; len++) lg[len] = lg[len / 2] + 1;
+    table.push_back(tree.preorder);
+    for (int k = 1; (1 << k) <= n; k++) {
+      const std::vector<int>& prev = table[k - 1];
+      std::vector<int> cur(n - (1 << k) + 1);
+      for (size_t q = 0; q < cur.size(); q++) {
+        cur[q] = shallower(prev[q], prev[q + (1 << (k - 1))]);
+      }
+      table.push_back(cur);
+    }
+  }
+
+  bool is_ancestor(const int& u, const int& v) const {
+    return pre[u] <= pre[v] && pre[v] < pre[u] + size[u];
+  }
+
+  int lca(const int& u, const int& v) const {
+    if (u == v) return u;
+    int l = std::min(pre[u], pre[v]) + 1, r = std::max(pre[u], pre[v]);
+    int k = lg[r - l + 1];
+    return tree.parent[shallower(table[k][l], table[k][r - (1 << k) + 1])];
+  }
+
+private:
+  const PhyloTree& tree;
+  std::vector<int> level;  // number of edges from the root
+  std::vector<int> lg;     // floor(log2(len))
+  std::vector<std::vector<int> > table;  // table[k][q]: shallowest node in q..(q + 2^k - 1)
+
+  int shallower(const int& u, const int& v) const { return level[u] <= level[v] ? u : v; }
+};
+
+
+
+/*
+ ***************************************************************************************
+ ***************************************************************************************
+
+ Community data and per-site kernels
+
+ ***************************************************************************************
+ ***************************************************************************************
+ */
+
+// Number of threads to use for a `nthreads` argument coming from R.
+inline int n_threads(const int& nthreads) {
+#ifdef _OPENMP
+  return nthreads > 1 ? nthreads : 1;
+#else
+  return 1;
+#endif
+}
+
+// Thread number inside a parallel region, 0 on the main thread
+inline int thread_id() {
+#ifdef _OPENMP
+  return omp_get_thread_num();
+#else
+  return 0;
+#endif
+}
+
+inline void check_interrupt_fn(void*) { R_CheckUserInterrupt(); }
+
+// Whether the user has asked to interrupt. Unlike Rcpp::checkUserInterrupt(),
+// this never jumps out, so the main thread can call it inside a parallel region
+// and let all threads stop; the caller then stops with an error.
+inline bool pending_interrupt() {
+  return R_ToplevelExec(check_interrupt_fn, NULL) == FALSE;
+}
+
+inline uint64_t mix64(uint64_t z) {
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+// 64-bit FNV-1a
+class Fnv64 {
+public:
+  uint64_t h;
+  Fnv64() : h(14695981039346656037ULL) {}
+  void add(const void* data, const size_t& len) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    for (size_t k = 0; k < len; k++) {
+      h ^= p[k];
+      h *= 1099511628211ULL;
+    }
+  }
+};
+
+// Random numbers for code running on several threads, where R's generator
+// cannot be used. SplitMix64 (Steele et al. 2014): the k-th draw is a hash of
+// the counter k, so stream r starts from a hash of (seed, r) and streams never
+// share state. Giving each replicate its own stream makes results independent
+// of the number of threads.
+class StreamRng {
+public:
+  StreamRng(const uint64_t& seed, const uint64_t& stream)
+    : s(mix64(seed ^ mix64(stream + 0x9E3779B97F4A7C15ULL))) {}
+
+  uint64_t next() {
+    s += 0x9E3779B97F4A7C15ULL;
+    return mix64(s);
+  }
+
+  // uniform on 0, ..., n - 1 (n > 0), without modulo bias
+  int below(const int& n) {
+    uint64_t un = (uint64_t)n;
+    uint64_t lim = UINT64_MAX - UINT64_MAX % un;
+    uint64_t x;
+    do x = next(); while (x >= lim);
+    return (int)(x % un);
+  }
+
+private:
+  uint64_t s;
+};
+
+
+// Species present (value > 0) at each site, stored row-wise (CSR) and built
+// once on the main thread, so that site loops only visit present species.
+// Dense and sparse (Matrix package) community data end up in the same form.
+class SiteSets {
+public:
+  int nsite;
+  int nsp;
+  std::vector<size_t> ptr;    // site i uses entries ptr[i]..(ptr[i + 1] - 1)
+  std::vector<int> idx;       // species (column) index, increasing within a site
+  std::vector<double> val;    // value in comm for each present species
+  std::vector<double> total;  // row sums of comm
+
+  // from a column-major dense site x species matrix
+  SiteSets(const double* comm, const int& nsite_, const int& nsp_)
+    : nsite(nsite_), nsp(nsp_), ptr(nsite_ + 1, 0), idx(), val(),
+      total(nsite_, 0.0) {
+    for (int k = 0; k < nsp; k++) {
+      const double* col = comm + (size_t)k * nsite;
+      for (int i = 0; i < nsite; i++) {
+        total[i] += col[i];
+        if (col[i] > 0) ptr[i + 1]++;
+      }
+    }
+    for (int i = 0; i < nsite; i++) ptr[i + 1] += ptr[i];
+    idx.resize(ptr[nsite]);
+    val.resize(ptr[nsite]);
+    std::vector<size_t> pos(ptr.begin(), ptr.end() - 1);
+    for (int k = 0; k < nsp; k++) {
+      const double* col = comm + (size_t)k * nsite;
+      for (int i = 0; i < nsite; i++) {
+        if (col[i] > 0) {
+          idx[pos[i]] = k;
+          val[pos[i]++] = col[i];
+        }
+      }
+    }
+  }
+
+  // from compressed sparse columns (dgCMatrix / ngCMatrix); `x` is NULL for
+  // pattern matrices, whose stored entries are all presences
+  static SiteSets from_csc(const int* cp, const int* ri, const double* x,
+                           const int& nsite_, const int& nsp_) {
+    SiteSets out(nsite_, nsp_);
+    for (int k = 0; k < out.nsp; k++) {
+      for (int e = cp[k]; e < cp[k + 1]; e++) {
+        double v = x ? x[e] : 1.0;
+        out.total[ri[e]] += v;
+        if (v > 0) out.ptr[ri[e] + 1]++;
+      }
+    }
+    for (int i = 0; i < out.nsite; i++) out.ptr[i + 1] += out.ptr[i];
+    out.idx.resize(out.ptr[out.nsite]);
+    out.val.resize(out.ptr[out.nsite]);
+    std::vector<size_t> pos(out.ptr.begin(), out.ptr.end() - 1);
+    for (int k = 0; k < out.nsp; k++) {
+      for (int e = cp[k]; e < cp[k + 1]; e++) {
+        double v = x ? x[e] : 1.0;
+        if (v > 0) {
+          out.idx[pos[ri[e]]] = k;
+          out.val[pos[ri[e]]++] = v;
+        }
+      }
+    }
+    return out;
+  }
+
+  // from compressed sparse rows (dgRMatrix / ngRMatrix)
+  static SiteSets from_csr(const int* rp, const int* cj, const double* x,
+                           const int& nsite_, const int& nsp_) {
+    SiteSets out(nsite_, nsp_);
+    for (int i = 0; i < out.nsite; i++) {
+      for (int e = rp[i]; e < rp[i + 1]; e++) {
+        double v = x ? x[e] : 1.0;
+        out.total[i] += v;
+        if (v > 0) {
+          out.idx.push_back(cj[e]);
+          out.val.push_back(v);
+        }
+      }
+      out.ptr[i + 1] = out.idx.size();
+    }
+    return out;
+  }
+
+  // the sites of `a` and then those of `b`, whose species k become species
+  // cols_a[k] (cols_b[k]) of nsp_ species, or are dropped if that is -1
+  static SiteSets stack(const SiteSets& a, const int* cols_a, const SiteSets& b,
+                        const int* cols_b, const int& nsp_) {
+    SiteSets out(a.nsite + b.nsite, nsp_);
+    std::vector<std::pair<int, double> > row;
+    for (int i = 0; i < out.nsite; i++) {
+      const SiteSets& s = i < a.nsite ? a : b;
+      const int* cols = i < a.nsite ? cols_a : cols_b;
+      int r = i < a.nsite ? i : i - a.nsite;
+      row.clear();
+      for (int e = 0; e < s.richness(r); e++) {
+        int k = cols[s.species(r)[e]];
+        if (k >= 0) row.push_back(std::make_pair(k, s.values(r)[e]));
+      }
+      std::sort(row.begin(), row.end());
+      for (size_t e = 0; e < row.size(); e++) {
+        out.idx.push_back(row[e].first);
+        out.val.push_back(row[e].second);
+        out.total[i] += row[e].second;
+      }
+      out.ptr[i + 1] = out.idx.size();
+    }
+    return out;
+  }
+
+  int richness(const int& i) const { return ptr[i + 1] - ptr[i]; }
+  const int* species(const int& i) const { return &idx[ptr[i]]; }
+  const double* values(const int& i) const { return &val[ptr[i]]; }
+
+private:
+  SiteSets(const int& nsite_, const int& nsp_)
+    : nsite(nsite_), nsp(nsp_), ptr(nsite_ + 1, 0), idx(), val(),
+      total(nsite_, 0.0) {}
+};
+
+
+// Site sets from community data coming from R: a numeric matrix, or a sparse
+// matrix from the Matrix package (dgCMatrix, dgRMatrix, or their pattern
+// versions ngCMatrix and ngRMatrix). Sparse data are never made dense.
+inline SiteSets as_site_sets(SEXP comm) {
+  if (Rf_isS4(comm)) {
+    bool csc = Rf_inherits(comm, "dgCMatrix") || Rf_inherits(comm, "ngCMatrix");
+    bool csr = Rf_inherits(comm, "dgRMatrix") || Rf_inherits(comm, "ngRMatrix");
+    if (!csc && !csr) {
+      Rcpp::stop("Sparse community data need to be a dgCMatrix or a dgRMatrix.");
+    }
+    Rcpp::S4 obj(comm);
+    Rcpp::IntegerVector dim = obj.slot("Dim");
+    Rcpp::IntegerVector p = obj.slot("p");
+    Rcpp::IntegerVector ix = obj.slot(csc ? "i" : "j");
+    Rcpp::NumericVector x;
+    const double* xp = NULL;
+    if (obj.hasSlot("x")) {
+      x = obj.slot("x");
+      xp = x.begin();
+    }
+    if (csc) return SiteSets::from_csc(p.begin(), ix.begin(), xp, dim[0], dim[1]);
+    return SiteSets::from_csr(p.begin(), ix.begin(), xp, dim[0], dim[1]);
+  }
+  Rcpp::NumericMatrix m(comm);
+  return SiteSets(m.begin(), m.nrow(), m.ncol());
+}
+
+
+// Sites that repeat the species set of an earlier site (with `values`, also its
+// values and total): first[i] is the first site with the same set as site i,
+// and i itself for the first one. Sites are grouped by a hash of their sets and
+// compared in full within a group, so kernels can compute each distinct set
+// once and copy its results to the repeats.
+inline std::vector<int> site_first_copy(const SiteSets& sites, const bool& values) {
+  std::vector<int> first(sites.nsite);
+  std::unordered_multimap<uint64_t, int> seen;
+  seen.reserve(sites.nsite);
+  for (int i = 0; i < sites.nsite; i++) {
+    int nsp = sites.richness(i);
+    const int* sp = sites.species(i);
+    const double* v = sites.values(i);
+    uint64_t h = 14695981039346656037ULL;
+    for (int a = 0; a < nsp; a++) {
+      h = (h ^ (uint64_t)sp[a]) * 1099511628211ULL;
+      if (values) {
+        uint64_t bits;
+        std::memcpy(&bits, &v[a], sizeof(bits));
+        h = (h ^ bits) * 1099511628211ULL;
+      }
+    }
+    h ^= (uint64_t)nsp;
+    first[i] = i;
+    typedef std::unordered_multimap<uint64_t, int>::const_iterator It;
+    std::pair<It, It> range = seen.equal_range(h);
+    for (It it = range.first; it != range.second; ++it) {
+      int j = it->second;
+      if (sites.richness(j) != nsp || !std::equal(sp, sp + nsp, sites.species(j))) continue;
+      if (values && (sites.total[j] != sites.total[i] ||
+                     !std::equal(v, v + nsp, sites.values(j)))) continue;
+      first[i] = j;
+      break;
+    }
+    if (first[i] == i) seen.insert(std::make_pair(h, i));
+  }
+  return first;
+}
+
+
+inline int popcount64(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_popcountll(x);
+#else
+  x = x - ((x >> 1) & 0x5555555555555555ULL);
+  x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+  x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+  return (int)((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+// position of the lowest set bit of x (> 0)
+inline int lowest_bit64(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_ctzll(x);
+#else
+  return popcount64((x & (0 - x)) - 1);
+#endif
+}
+
+// Species sets of sites as bitsets, in 64-bit words, for the sites with
+// keep[i] == i (e.g. the first site of each species set, see site_first_copy).
+// The species two sites share are then counted with popcounts, and those one
+// has but not the other come from the bits of w1 & ~w2.
+class SiteBits {
+public:
+  int nwords;
+
+  SiteBits(const SiteSets& sites, const std::vector<int>& keep)
+    : nwords((sites.nsp + 63) / 64), slot(sites.nsite, -1), bits() {
+    int ns = 0;
+    for (int i = 0; i < sites.nsite; i++) if (keep[i] == i) slot[i] = ns++;
+    bits.assign((size_t)ns * nwords, 0);
+    for (int i = 0; i < sites.nsite; i++) {
+      if (slot[i] < 0) continue;
+      uint64_t* w = &bits[(size_t)slot[i] * nwords];
+      const int* sp = sites.species(i);
+      for (int a = 0; a < sites.richness(i); a++) w[sp[a] >> 6] |= (uint64_t)1 << (sp[a] & 63);
+    }
+  }
+
+  const uint64_t* site(const int& i) const { return &bits[(size_t)slot[i] * nwords]; }
+
+  int shared(const int& i, const int& j) const {
+    const uint64_t* w1 = site(i);
+    const uint64_t* w2 = site(j);
+    int n = 0;
+    for (int w = 0; w < nwords; w++) n += popcount64(w1[w] & w2[w]);
+    return n;
+  }
+
+  // species of site i that site j does not have, in increasing order, into out
+  template <typename T>
+  int only_in(const int& i, const int& j, T* out) const {
+    const uint64_t* w1 = site(i);
+    const uint64_t* w2 = site(j);
+    int k = 0;
+    for (int w = 0; w < nwords; w++) {
+      for (uint64_t x = w1[w] & ~w2[w]; x; x &= x - 1) out[k++] = (w << 6) + lowest_bit64(x);
+    }
+    return k;
+  }
+
+private:
+  std::vector<int> slot;
+  std::vector<uint64_t> bits;
+};
+
+
+// Read-only view of a column-major covariance matrix.
+class DenseCov {
+public:
+  const double* x;
+  size_t n;
+  DenseCov(const double* x_, const size_t& n_) : x(x_), n(n_) {}
+  double operator()(const int& i, const int& j) const { return x[i + j * n]; }
+};
+
+// Read-only view of a symmetric covariance matrix stored as its upper triangle
+// packed by columns (element (i, j), i <= j, at j * (j + 1) / 2 + i), in double
+// or float precision.
+template <typename T>
+class PackedCov {
+public:
+  const T* x;
+  size_t n;
+  PackedCov(const T* x_, const size_t& n_) : x(x_), n(n_) {}
+  double operator()(const int& i, const int& j) const {
+    return i <= j ? x[(size_t)j * (j + 1) / 2 + i] : x[(size_t)i * (i + 1) / 2 + j];
+  }
+};
+
+inline size_t packed_size(const size_t& n) { return n * (n + 1) / 2; }
+
+
+// Phylogenetic var-cov matrix coming from R: a numeric matrix, or a "packed_vcv"
+// object from vcv2(packed = TRUE), whose `x` is the packed upper triangle, as a
+// numeric vector or, for float = TRUE, as float32 values in a raw vector.
+// Kernels with per-element access use dense(), packed() or packed_float() through
+// a template; the others take copies of submatrices with submat().
+class CovInput {
+public:
+  enum Kind { DENSE, PACKED, PACKED_FLOAT };
+  Kind kind;
+  int n;
+
+  CovInput(SEXP Cmatrix) {
+    if (Rf_inherits(Cmatrix, "packed_vcv")) {
+      Rcpp::List obj(Cmatrix);
+      SEXP x = obj["x"];
+      store = x;
+      n = Rcpp::as<int>(obj["n"]);
+      kind = TYPEOF(store) == RAWSXP ? PACKED_FLOAT : PACKED;
+      size_t len = kind == PACKED_FLOAT ? Rf_xlength(store) / sizeof(float) : Rf_xlength(store);
+      if ((kind == PACKED && TYPEOF(store) != REALSXP) || len != packed_size(n)) {
+        Rcpp::stop("Malformed packed_vcv object.");
+      }
+    } else {
+      Rcpp::NumericMatrix m(Cmatrix);
+      if (m.nrow() != m.ncol()) Rcpp::stop("The var-cov matrix needs to be square.");
+      store = m;
+      n = m.nrow();
+      kind = DENSE;
+    }
+    // taken once here, so that views can be made on any thread
+    data = kind == PACKED_FLOAT ? (const void*)RAW(store) : (const void*)REAL(store);
+  }
+
+  DenseCov dense() const { return DenseCov(static_cast<const double*>(data), n); }
+  PackedCov<double> packed() const {
+    return PackedCov<double>(static_cast<const double*>(data), n);
+  }
+  PackedCov<float> packed_float() const {
+    return PackedCov<float>(static_cast<const float*>(data), n);
+  }
+
+  double operator()(const int& i, const int& j) const {
+    switch (kind) {
+    case PACKED: return packed()(i, j);
+    case PACKED_FLOAT: return packed_float()(i, j);
+    default: return dense()(i, j);
+    }
+  }
+
+  // the stored values and their size in bytes, e.g. to hash them
+  const void* values() const { return data; }
+  size_t bytes() const {
+    switch (kind) {
+    case PACKED: return packed_size(n) * sizeof(double);
+    case PACKED_FLOAT: return packed_size(n) * sizeof(float);
+    default: return (size_t)n * n * sizeof(double);
+    }
+  }
+
+  // C[rows, cols] as a dense matrix
+  arma::mat submat(const arma::uvec& rows, const arma::uvec& cols) const {
+    switch (kind) {
+    case PACKED: return gather(packed(), rows, cols);
+    case PACKED_FLOAT: return gather(packed_float(), rows, cols);
+    default: return gather(dense(), rows, cols);
+    }
+  }
+
+  // C[rows, cols] into out, column-major, with no allocation
+  template <typename I, typename J>
+  void fill(const I* rows, const int& nr, const J* cols, const int& nc, double* out) const {
+    switch (kind) {
+    case PACKED: fill(packed(), rows, nr, cols, nc, out); break;
+    case PACKED_FLOAT: fill(packed_float(), rows, nr, cols, nc, out); break;
+    default: fill(dense(), rows, nr, cols, nc, out);
+    }
+  }
+
+private:
+  Rcpp::RObject store;
+  const void* data;
+
+  template <typename Cov>
+  static arma::mat gather(const Cov& C, const arma::uvec& rows, const arma::uvec& cols) {
+    arma::mat out(rows.n_elem, cols.n_elem);
+    for (arma::uword b = 0; b < cols.n_elem; b++) {
+      for (arma::uword a = 0; a < rows.n_elem; a++) out(a, b) = C(rows(a), cols(b));
+    }
+    return out;
+  }
+
+  template <typename Cov, typename I, typename J>
+  static void fill(const Cov& C, const I* rows, const int& nr, const J* cols, const int& nc,
+                   double* out) {
+    for (int b = 0; b < nc; b++) {
+      for (int a = 0; a < nr; a++) out[a + (size_t)b * nr] = C(rows[a], cols[b]);
+    }
+  }
+};
+
+
+// PSV of one site from the covariances among its `nsp` (> 1) species
+template <typename Cov>
+inline double psv_site(const Cov& C, const int* sp, const int& nsp) {
+  double tr = 0, acc = 0;
+  for (int a = 0; a < nsp; a++) {
+    tr += C(sp[a], sp[a]);
+    for (int b = 0; b < nsp; b++) acc += C(sp[a], sp[b]);
+  }
+  return (nsp * tr - acc) / (nsp * (nsp - 1));
+}
+
+// PSE of one site; `M` holds the abundances of its `nsp` (> 1) species and
+// `N` is the site's total abundance
+template <typename Cov>
+inline double pse_site(const Cov& C, const int* sp, const double* M,
+                       const int& nsp, const double& N) {
+  double dm = 0, mcm = 0, msum = 0;
+  for (int a = 0; a < nsp; a++) {
+    dm += C(sp[a], sp[a]) * M[a];
+    msum += M[a];
+    double cm = 0;
+    for (int b = 0; b < nsp; b++) cm += C(sp[a], sp[b]) * M[b];
+    mcm += M[a] * cm;
+  }
+  double mbar = msum / nsp;
+  double dem = N * N - N * mbar;
+  return (N * dm - mcm) / dem;
+}
+
+
+// PSC of one site from the covariances among its `nsp` (> 1) species: one minus
+// the mean, over species, of the largest covariance with another species
+template <typename Cov>
+inline double psc_site(const Cov& C, const int* sp, const int& nsp) {
+  double acc = 0;
+  for (int a = 0; a < nsp; a++) {
+    double mx = -1;
+    for (int b = 0; b < nsp; b++) {
+      if (b != a) mx = std::max(mx, C(sp[a], sp[b]));
+    }
+    acc += mx;
+  }
+  return 1 - acc / nsp;
+}
+
+// PSV, PSC and PSE of one site from a single pass over the covariances among
+// its `nsp` (> 1) species; same arithmetic as psv_site, psc_site and pse_site.
+template <typename Cov>
+inline void psd_site(const Cov& C, const int* sp, const double* M,
+                     const int& nsp, const double& N,
+                     double& psv, double& psc, double& pse) {
+  double tr = 0, acc = 0, mxs = 0, dm = 0, mcm = 0, msum = 0;
+  for (int a = 0; a < nsp; a++) {
+    double caa = C(sp[a], sp[a]);
+    tr += caa;
+    dm += caa * M[a];
+    msum += M[a];
+    double cm = 0, mx = -1;
+    for (int b = 0; b < nsp; b++) {
+      double c = C(sp[a], sp[b]);
+      acc += c;
+      cm += c * M[b];
+      if (b != a) mx = std::max(mx, c);
+    }
+    mcm += M[a] * cm;
+    mxs += mx;
+  }
+  psv = (nsp * tr - acc) / (nsp * (nsp - 1));
+  psc = 1 - mxs / nsp;
+  double mbar = msum / nsp;
+  pse = (N * dm - mcm) / (N * N - N * mbar);
+}
+
+
+/*
+ ***************************************************************************************
+ ***************************************************************************************
+
+ Expected PSV variances
+
+ ***************************************************************************************
+ ***************************************************************************************
+ */
+
+// SS1 and SS2 (Helmus et al. 2007) of the `n` species in C, from the
+// off-diagonal covariances centred on their mean, with O(n) extra memory:
+// row sums first, then one pass over the upper triangle in which every column
+// keeps its own partial sums. Blocks of columns are shared among threads and
+// the partial sums added in column order, so results do not depend on
+// `nthreads`. Works for any storage of C.
+template <typename Cov>
+inline void psv_ss(const Cov& C, const int& n, double& SS1, double& SS2,
+                   const int& nthreads = 1) {
+  std::vector<double> rs(n), p1(n), p2(n);
+  // off-diagonal row sums; C is symmetric, so these are column sums
+#pragma omp parallel for schedule(dynamic, 64) num_threads(n_threads(nthreads))
+  for (int j = 0; j < n; j++) {
+    double r = 0;
+    for (int i = 0; i < j; i++) r += C(i, j);
+    for (int i = j + 1; i < n; i++) r += C(i, j);
+    rs[j] = r;
+  }
+  double total = 0;
+  for (int j = 0; j < n; j++) total += rs[j] + C(j, j);
+  // as in the R code: mean of C - I over the off-diagonal cells
+  double cbar = (total - n) / (n * (n - 1.0));
+#pragma omp parallel for schedule(dynamic, 64) num_threads(n_threads(nthreads))
+  for (int j = 0; j < n; j++) {
+    double s1 = 0, s2 = 0;
+    for (int i = 0; i < j; i++) {
+      double x = C(i, j) - cbar;
+      s1 += x * x;
+      s2 += x * (rs[i] - (n - 1) * cbar - x);
+    }
+    p1[j] = s1;
+    p2[j] = s2;
+  }
+  SS1 = 0;
+  SS2 = 0;
+  for (int j = 0; j < n; j++) {
+    SS1 += p1[j];
+    SS2 += p2[j];
+  }
+  return;
+}
+
+// Given SS1 and SS2 (Helmus et al. 2007) for a pool of `nspecies` species,
+// fill in the expected PSV variance for each site's species richness.
+inline void psv_vars_from_ss(const double& SS1, const double& SS2,
+                             const int& nspecies,
+                             const Rcpp::NumericVector& SR,
+                             Rcpp::NumericVector& PSVvar) {
+  double SS3 = (-1 * SS1) - SS2;
+  double S1 = SS1 * 2.0/(nspecies * (nspecies - 1.0));
+  double S2 = SS2 * 2.0/(nspecies * (nspecies - 1.0) * (nspecies - 2.0)); // 1.0 not 1 !!
+  double S3;
+  if (nspecies == 3) {
+    S3 = 0;
+  } else {
+    S3 = SS3 * 2.0/(nspecies * (nspecies - 1.0) * (nspecies - 2.0) * (nspecies - 3.0));
+  }
+  Rcpp::NumericVector PSVary(nspecies - 1);
+  for (int ni = 1; ni < (nspecies - 1); ni++) {
+    double nii = ni + 1; // need to be double, not int
+    PSVary[ni - 1] = 2.0/(nii * (nii - 1)) * (S1 + (nii - 2) * S2 + (nii - 2) * (nii - 3) * S3);
+  }
+  for (int g = 0; g < SR.size(); g++) {
+    if (SR[g] > 1) {
+      PSVvar[g] = PSVary[(SR[g] - 2)];
+    } else {
+      PSVvar[g] = NA_REAL;
+    }
+  }
+  return;
+}
+
+
+#endif
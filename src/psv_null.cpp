@@ -0,0 +1,235 @@
+// -*- mode: C++; c-indent-level: 4; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#include "RcppArmadillo.h"
+#include "psv.h"
+#include <algorithm>
+#include <stdint.h>
+
+using namespace Rcpp;
+
+
+/*
+ ***************************************************************************************
+ ***************************************************************************************
+
+ Null models for standardized effect sizes of PSV, PSE and PSC (see ses.psd)
+
+ The community data and the var-cov matrix are read once; every replicate
+ randomizes the sites from the observed data and computes the metric of all
+ sites, on its own random stream. Results therefore depend only on the seed,
+ not on the number of threads or the order replicates are run in.
+
+ ***************************************************************************************
+ ***************************************************************************************
+ */
+
+enum NullModel { TAXA_LABELS = 0, RICHNESS = 1, INDEPENDENT_SWAP = 2 };
+enum NullMetric { NULL_PSV = 0, NULL_PSE = 1, NULL_PSC = 2 };
+
+template <typename Cov>
+static inline double null_site(const Cov& C, const int& metric, const int* sp,
+                               const double* M, const int& nsp, const double& N) {
+  if (nsp < 2) return NA_REAL;
+  switch (metric) {
+  case NULL_PSE: return pse_site(C, sp, M, nsp, N);
+  case NULL_PSC: return psc_site(C, sp, nsp);
+  default: return psv_site(C, sp, nsp);
+  }
+}
+
+// Position of species j in the sorted list s of nsp species, or -1
+static inline int find_species(const int* s, const int& nsp, const int& j) {
+  const int* e = std::lower_bound(s, s + nsp, j);
+  return e != s + nsp && *e == j ? (int)(e - s) : -1;
+}
+
+// Give entry k of the sorted list s (with values v) the species `to`, moving
+// it, with its value, to keep the list sorted
+static inline void move_species(int* s, double* v, const int& nsp, int k, const int& to) {
+  double x = v[k];
+  for (; k + 1 < nsp && s[k + 1] < to; k++) {
+    s[k] = s[k + 1];
+    v[k] = v[k + 1];
+  }
+  for (; k > 0 && s[k - 1] > to; k--) {
+    s[k] = s[k - 1];
+    v[k] = v[k - 1];
+  }
+  s[k] = to;
+  v[k] = x;
+}
+
+// Independent swap (Gotelli 2000) on the species lists of `sites`, copied into
+// idx and val: `iterations` attempts, each picking two sites and two species at
+// random and swapping the checkerboard if there is one. Values move within
+// their site, so site richness, site totals and species frequencies are all
+// kept, and so is the layout of the lists: no site by species matrix is made.
+static void independent_swap(const SiteSets& sites, std::vector<int>& idx,
+                             std::vector<double>& val, const int& iterations,
+                             StreamRng& rng) {
+  int m = sites.nsite, n = sites.nsp;
+  if (m < 2 || n < 2) return;
+  for (int t = 0; t < iterations; t++) {
+    int i1 = rng.below(m), i2 = rng.below(m - 1);
+    if (i2 >= i1) i2++;
+    int j1 = rng.below(n), j2 = rng.below(n - 1);
+    if (j2 >= j1) j2++;
+    int n1 = sites.richness(i1), n2 = sites.richness(i2);
+    int* s1 = idx.data() + sites.ptr[i1];
+    int* s2 = idx.data() + sites.ptr[i2];
+    int a = find_species(s1, n1, j1);
+    if (a < 0) continue;
+    int b = find_species(s2, n2, j2);
+    if (b < 0 || find_species(s1, n1, j2) >= 0 || find_species(s2, n2, j1) >= 0) continue;
+    move_species(s1, val.data() + sites.ptr[i1], n1, a, j2);
+    move_species(s2, val.data() + sites.ptr[i2], n2, b, j1);
+  }
+}
+
+// Metric of every site for replicates r0..(r1 - 1); replicate r fills
+// null[(r - r0) * nsite + (0..nsite - 1)].
+template <typename Cov>
+static void null_runs(const Cov& C, const SiteSets& sites, const int& metric,
+                      const int& model, const int& iterations, const uint64_t& seed,
+                      const int& r0, const int& r1, double* null, const int& nthreads) {
+  int m = sites.nsite, n = sites.nsp;
+#pragma omp parallel num_threads(n_threads(nthreads))
+{
+  std::vector<int> perm(n), swaps, sp, idx;
+  std::vector<double> val;
+#pragma omp for schedule(dynamic, 1)
+  for (int r = r0; r < r1; r++) {
+    StreamRng rng(seed, r);
+    double* res = null + (size_t)(r - r0) * m;
+    if (model == INDEPENDENT_SWAP) {
+      idx.assign(sites.idx.begin(), sites.idx.end());
+      val.assign(sites.val.begin(), sites.val.end());
+      independent_swap(sites, idx, val, iterations, rng);
+      for (int i = 0; i < m; i++) {
+        res[i] = null_site(C, metric, idx.data() + sites.ptr[i], val.data() + sites.ptr[i],
+                           sites.richness(i), sites.total[i]);
+      }
+    } else if (model == TAXA_LABELS) {
+      // one shuffle of the species labels for all sites
+      for (int k = 0; k < n; k++) perm[k] = k;
+      for (int k = n - 1; k > 0; k--) std::swap(perm[k], perm[rng.below(k + 1)]);
+      for (int i = 0; i < m; i++) {
+        int nsp = sites.richness(i);
+        const int* s = sites.species(i);
+        sp.resize(nsp);
+        for (int k = 0; k < nsp; k++) sp[k] = perm[s[k]];
+        res[i] = null_site(C, metric, sp.data(), sites.values(i), nsp, sites.total[i]);
+      }
+    } else {
+      // richness: each site draws as many species from the pool as it has, by
+      // a partial Fisher-Yates shuffle that is undone afterwards, and gives
+      // them its values in the order drawn
+      for (int k = 0; k < n; k++) perm[k] = k;
+      for (int i = 0; i < m; i++) {
+        int nsp = sites.richness(i);
+        swaps.resize(nsp);
+        for (int k = 0; k < nsp; k++) {
+          swaps[k] = k + rng.below(n - k);
+          std::swap(perm[k], perm[swaps[k]]);
+        }
+        res[i] = null_site(C, metric, perm.data(), sites.values(i), nsp, sites.total[i]);
+        for (int k = nsp - 1; k >= 0; k--) std::swap(perm[k], perm[swaps[k]]);
+      }
+    }
+  }
+}
+}
+
+template <typename Cov>
+static void null_obs(const Cov& C, const SiteSets& sites, const int& metric,
+                     double* obs, const int& nthreads) {
+#pragma omp parallel for schedule(dynamic, 64) num_threads(n_threads(nthreads))
+  for (int i = 0; i < sites.nsite; i++) {
+    obs[i] = null_site(C, metric, sites.species(i), sites.values(i), sites.richness(i),
+                       sites.total[i]);
+  }
+}
+
+// Standardized effect sizes of PSV (metric 0), PSE (1) or PSC (2) against
+// `runs` randomizations of `comm` by null model 0 (taxa.labels), 1 (richness)
+// or 2 (independentswap). Replicates are run in chunks, with a check for user
+// interrupts between chunks; each chunk is folded into running summaries of
+// every site before the next one, so memory does not grow with `runs`.
+// [[Rcpp::export]]
+DataFrame ses_cpp(SEXP comm, SEXP Cmatrix, const int metric, const int null_model,
+                  const int runs, const int iterations, const double seed,
+                  const int nthreads = 1){
+  SiteSets sites = as_site_sets(comm);
+  CovInput C(Cmatrix);
+  int m = sites.nsite;
+  uint64_t sd = (uint64_t)seed;
+  NumericVector obs(m);
+  int chunk = 16 * n_threads(nthreads);
+  std::vector<double> null((size_t)std::max(0, std::min(runs, chunk)) * m);
+  switch(C.kind){
+  case CovInput::PACKED: null_obs(C.packed(), sites, metric, obs.begin(), nthreads); break;
+  case CovInput::PACKED_FLOAT: null_obs(C.packed_float(), sites, metric, obs.begin(), nthreads); break;
+  default: null_obs(C.dense(), sites, metric, obs.begin(), nthreads);
+  }
+  
+  // running summaries over the replicates where the metric is defined: their
+  // number, mean and sum of squared deviations (Welford), and how many are
+  // below or equal to the observed value
+  std::vector<int> cnt(m, 0);
+  std::vector<double> mean(m, 0.0), m2(m, 0.0), less(m, 0.0), ties(m, 0.0);
+  for(int r0 = 0; r0 < runs; r0 += chunk){
+    int r1 = std::min(runs, r0 + chunk);
+    switch(C.kind){
+    case CovInput::PACKED:
+      null_runs(C.packed(), sites, metric, null_model, iterations, sd, r0, r1, null.data(), nthreads); break;
+    case CovInput::PACKED_FLOAT:
+      null_runs(C.packed_float(), sites, metric, null_model, iterations, sd, r0, r1, null.data(), nthreads); break;
+    default:
+      null_runs(C.dense(), sites, metric, null_model, iterations, sd, r0, r1, null.data(), nthreads);
+    }
+    for(int r = 0; r < r1 - r0; r++){
+      const double* res = &null[(size_t)r * m];
+      for(int i = 0; i < m; i++){
+        double v = res[i];
+        if(ISNAN(v)) continue;
+        cnt[i]++;
+        double d = v - mean[i];
+        mean[i] += d / cnt[i];
+        m2[i] += d * (v - mean[i]);
+        if(v < obs[i]) less[i]++;
+        else if(v == obs[i]) ties[i]++;
+      }
+    }
+    Rcpp::checkUserInterrupt();
+  }
+
+  // the rank of the observed value among the replicates averages ties, as
+  // rank() does in R
+  NumericVector SR(m), rmean(m), rsd(m), rank(m), z(m), p(m);
+  IntegerVector nruns(m);
+  for(int i = 0; i < m; i++){
+    SR[i] = sites.richness(i);
+    nruns[i] = cnt[i];
+    rmean[i] = cnt[i] > 0 ? mean[i] : NA_REAL;
+    rsd[i] = cnt[i] > 1 ? std::sqrt(m2[i] / (cnt[i] - 1)) : NA_REAL;
+    if(ISNAN(obs[i])){
+      rank[i] = NA_REAL;
+      z[i] = NA_REAL;
+      p[i] = NA_REAL;
+    } else {
+      rank[i] = 1 + less[i] + ties[i] / 2;
+      z[i] = (obs[i] - rmean[i]) / rsd[i];
+      p[i] = rank[i] / (cnt[i] + 1);
+    }
+  }
+  return DataFrame::create(
+    _["SR"] = SR,
+    _["obs"] = obs,
+    _["rand.mean"] = rmean,
+    _["rand.sd"] = rsd,
+    _["obs.rank"] = rank,
+    _["obs.z"] = z,
+    _["obs.p"] = p,
+    _["runs"] = nruns
+  );
+}
@@ -0,0 +1,244 @@
+// -*- mode: C++; c-indent-level: 4; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#include "RcppArmadillo.h"
+#include "psv.h"
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+using namespace Rcpp;
+
+
+/*
+ ***************************************************************************************
+ ***************************************************************************************
+
+ PSV and PSE of a changing set of sites (see psv_state in R)
+
+ Each site keeps the sums PSV and PSE are made of, over the covariances among its
+ species. Setting the abundance of one species at a site only adds or removes
+ that species' row of the site's covariances, so it takes time proportional to
+ the site's richness; reading the table needs no recomputation at all. So that
+ rounding errors do not build up over many updates, a site's sums are computed
+ again from its species once it has had more updates than it has species (and
+ at least 64), and when removed sites are dropped; this keeps the time per
+ update proportional to the richness.
+
+ ***************************************************************************************
+ ***************************************************************************************
+ */
+
+struct StateSite {
+  std::string name;
+  bool alive;
+  std::vector<int> sp;      // species in the pool, in the order they were added
+  std::vector<double> val;  // abundance of each of them
+  double tr;   // sum of C[a, a]
+  double acc;  // sum of C[a, b]
+  double N;    // total abundance
+  double dm;   // sum of C[a, a] * M[a]
+  double mcm;  // sum of M[a] * C[a, b] * M[b]
+  size_t nupd; // updates since the sums were last computed from scratch
+};
+
+class PsvState {
+public:
+  CovInput C;
+  std::vector<StateSite> sites;
+  std::unordered_map<std::string, int> index;  // alive sites by name
+  int nalive;
+
+  PsvState(SEXP Cmatrix) : C(Cmatrix), sites(), index(), nalive(0) {}
+
+  int find(const std::string& name) const {
+    std::unordered_map<std::string, int>::const_iterator it = index.find(name);
+    return it == index.end() ? -1 : it->second;
+  }
+
+  int add(const std::string& name) {
+    StateSite s;
+    s.name = name;
+    s.alive = true;
+    s.tr = s.acc = s.N = s.dm = s.mcm = 0;
+    s.nupd = 0;
+    sites.push_back(s);
+    index[name] = sites.size() - 1;
+    nalive++;
+    return sites.size() - 1;
+  }
+
+  void remove(const int& i) {
+    index.erase(sites[i].name);
+    sites[i].alive = false;
+    std::vector<int>().swap(sites[i].sp);
+    std::vector<double>().swap(sites[i].val);
+    nalive--;
+    // drop removed sites once they are the majority
+    if ((int)sites.size() > 2 * nalive + 64) {
+      std::vector<StateSite> keep;
+      keep.reserve(nalive);
+      index.clear();
+      for (size_t k = 0; k < sites.size(); k++) {
+        if (!sites[k].alive) continue;
+        index[sites[k].name] = keep.size();
+        keep.push_back(sites[k]);
+        resync(keep.back());
+      }
+      sites.swap(keep);
+    }
+  }
+
+  // abundance of species k at site i becomes v (0 to remove it)
+  void set(const int& i, const int& k, const double& v) {
+    StateSite& s = sites[i];
+    int pos = -1;
+    for (size_t a = 0; a < s.sp.size(); a++) {
+      if (s.sp[a] == k) {
+        pos = a;
+        break;
+      }
+    }
+    if (pos >= 0) {
+      double u = s.val[pos];
+      s.sp[pos] = s.sp.back();
+      s.val[pos] = s.val.back();
+      s.sp.pop_back();
+      s.val.pop_back();
+      update(s, k, u, -1);
+    }
+    if (v > 0) {
+      update(s, k, v, 1);
+      s.sp.push_back(k);
+      s.val.push_back(v);
+    }
+    if (s.sp.empty() || ++s.nupd > std::max<size_t>(64, s.sp.size())) resync(s);
+  }
+
+private:
+  // the sums of site s from scratch, O(richness^2)
+  void resync(StateSite& s) {
+    s.tr = s.acc = s.N = s.dm = s.mcm = 0;
+    for (size_t a = 0; a < s.sp.size(); a++) {
+      double caa = C(s.sp[a], s.sp[a]), ra = 0, wa = 0;
+      for (size_t b = 0; b < s.sp.size(); b++) {
+        double c = C(s.sp[a], s.sp[b]);
+        ra += c;
+        wa += c * s.val[b];
+      }
+      s.tr += caa;
+      s.acc += ra;
+      s.N += s.val[a];
+      s.dm += caa * s.val[a];
+      s.mcm += s.val[a] * wa;
+    }
+    s.nupd = 0;
+  }
+
+  // add (sign 1) or take away (sign -1) species k with abundance v, against the
+  // other species of the site
+  void update(StateSite& s, const int& k, const double& v, const int& sign) {
+    double ckk = C(k, k), rk = 0, wk = 0;
+    for (size_t b = 0; b < s.sp.size(); b++) {
+      double c = C(k, s.sp[b]);
+      rk += c;
+      wk += c * s.val[b];
+    }
+    s.tr += sign * ckk;
+    s.acc += sign * (2 * rk + ckk);
+    s.N += sign * v;
+    s.dm += sign * ckk * v;
+    s.mcm += sign * (2 * v * wk + v * v * ckk);
+  }
+};
+
+static PsvState* state_ptr(SEXP ptr) {
+  XPtr<PsvState> p(ptr);
+  if (!R_ExternalPtrAddr(ptr)) stop("The psv_state is no longer valid (was it saved and loaded?).");
+  return p.get();
+}
+
+// [[Rcpp::export]]
+SEXP psv_state_new_cpp(SEXP Cmatrix){
+  return XPtr<PsvState>(new PsvState(Cmatrix), true);
+}
+
+// Add the sites of `comm`, whose columns are the species `cols` (0-based, -1
+// for species not in the pool) of the state's var-cov matrix.
+// [[Rcpp::export]]
+void psv_state_add_cpp(SEXP ptr, SEXP comm, const IntegerVector& cols,
+                       const CharacterVector& names){
+  PsvState* st = state_ptr(ptr);
+  SiteSets sites = as_site_sets(comm);
+  std::unordered_set<std::string> seen;
+  for(int i = 0; i < sites.nsite; i++){
+    std::string nm = as<std::string>(names[i]);
+    if(st->find(nm) >= 0) stop("Site " + nm + " is already in the psv_state.");
+    if(!seen.insert(nm).second) stop("Site " + nm + " is given twice.");
+  }
+  for(int i = 0; i < sites.nsite; i++){
+    int s = st->add(as<std::string>(names[i]));
+    const int* sp = sites.species(i);
+    const double* v = sites.values(i);
+    for(int a = 0; a < sites.richness(i); a++){
+      if(cols[sp[a]] >= 0) st->set(s, cols[sp[a]], v[a]);
+    }
+  }
+}
+
+// [[Rcpp::export]]
+void psv_state_remove_cpp(SEXP ptr, const CharacterVector& names){
+  PsvState* st = state_ptr(ptr);
+  for(int i = 0; i < names.size(); i++){
+    int s = st->find(as<std::string>(names[i]));
+    if(s < 0) stop("Site " + as<std::string>(names[i]) + " is not in the psv_state.");
+    st->remove(s);
+  }
+}
+
+// abundances `value` of species `sp` (0-based) at sites `names`, one by one
+// [[Rcpp::export]]
+void psv_state_set_cpp(SEXP ptr, const CharacterVector& names, const IntegerVector& sp,
+                       const NumericVector& value){
+  PsvState* st = state_ptr(ptr);
+  for(int i = 0; i < names.size(); i++){
+    int s = st->find(as<std::string>(names[i]));
+    if(s < 0) stop("Site " + as<std::string>(names[i]) + " is not in the psv_state.");
+    if(sp[i] < 0 || sp[i] >= st->C.n) stop("Species not found in the psv_state.");
+    if(ISNAN(value[i]) || value[i] < 0) stop("Abundances need to be 0 or more.");
+    st->set(s, sp[i], value[i]);
+  }
+}
+
+// PSV, PSE and richness of the current sites, in the order they were added
+// [[Rcpp::export]]
+DataFrame psv_state_table_cpp(SEXP ptr){
+  PsvState* st = state_ptr(ptr);
+  int m = st->nalive;
+  NumericVector PSVs(m), PSEs(m), SR(m);
+  CharacterVector names(m);
+  int i = 0;
+  for(size_t k = 0; k < st->sites.size(); k++){
+    const StateSite& s = st->sites[k];
+    if(!s.alive) continue;
+    double nsp = s.sp.size();
+    names[i] = s.name;
+    SR[i] = nsp;
+    if(nsp > 1){
+      PSVs[i] = (nsp * s.tr - s.acc) / (nsp * (nsp - 1));
+      double mbar = s.N / nsp;
+      PSEs[i] = (s.N * s.dm - s.mcm) / (s.N * s.N - s.N * mbar);
+    } else {
+      PSVs[i] = NA_REAL;
+      PSEs[i] = NA_REAL;
+    }
+    i++;
+  }
+  DataFrame out = DataFrame::create(
+    _["PSVs"] = PSVs,
+    _["PSEs"] = PSEs,
+    _["SR"] = SR
+  );
+  out.attr("row.names") = names;
+  return out;
+}
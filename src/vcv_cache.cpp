@@ -0,0 +1,137 @@
+// -*- mode: C++; c-indent-level: 4; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#include <RcppArmadillo.h>
+#include "psv.h"
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <stdint.h>
+
+using namespace Rcpp;
+
+
+/*
+ ***************************************************************************************
+ ***************************************************************************************
+
+ Cache of phylogenetic var-cov matrices (see R/cache.R)
+
+ Files hold a 24-byte header (magic, storage kind, number of species) followed
+ by the values as they are stored in R: the full matrix (kind 0), the packed
+ upper triangle in double (kind 1) or in float32 (kind 2).
+
+ ***************************************************************************************
+ ***************************************************************************************
+ */
+
+static const char vcv_magic[8] = {'P', 'H', 'Y', 'R', 'V', 'C', 'V', '1'};
+
+struct VcvHeader {
+  char magic[8];
+  int32_t kind;
+  int32_t pad;
+  int64_t n;
+};
+
+static size_t vcv_data_bytes(const int& kind, const int64_t& n) {
+  size_t len = kind == 0 ? (size_t)n * n : (size_t)n * (n + 1) / 2;
+  return len * (kind == 2 ? sizeof(float) : sizeof(double));
+}
+
+
+// Key of the var-cov matrix of a tree: a hash of its edges, branch lengths and
+// tip labels, and of the options the matrix was built with.
+// [[Rcpp::export]]
+std::string vcv_hash_cpp(const IntegerVector& e1, const IntegerVector& e2,
+                         const NumericVector& EL, const CharacterVector& tips,
+                         const IntegerVector& flags){
+  Fnv64 f;
+  int sizes[3] = {(int)e1.size(), (int)tips.size(), (int)flags.size()};
+  f.add(sizes, sizeof(sizes));
+  f.add(e1.begin(), e1.size() * sizeof(int));
+  f.add(e2.begin(), e2.size() * sizeof(int));
+  f.add(EL.begin(), EL.size() * sizeof(double));
+  for (int t = 0; t < tips.size(); t++) {
+    const char* s = CHAR(STRING_ELT(tips, t));
+    size_t len = std::strlen(s);
+    f.add(&len, sizeof(len));
+    f.add(s, len);
+  }
+  f.add(flags.begin(), flags.size() * sizeof(int));
+  char out[17];
+  std::snprintf(out, sizeof(out), "%016llx", (unsigned long long)f.h);
+  return std::string(out);
+}
+
+
+// Write the values of `x` (a numeric matrix, numeric vector or raw vector, as
+// given by `kind`) for `n` species to `path`.
+// [[Rcpp::export]]
+bool vcv_write_cpp(SEXP x, const std::string& path, const int& kind, const double& n){
+  VcvHeader hdr;
+  std::memcpy(hdr.magic, vcv_magic, sizeof(vcv_magic));
+  hdr.kind = kind;
+  hdr.pad = 0;
+  hdr.n = (int64_t)n;
+  size_t bytes = vcv_data_bytes(kind, hdr.n);
+  const void* data = kind == 2 ? (const void*)RAW(x) : (const void*)REAL(x);
+  if ((size_t)Rf_xlength(x) * (kind == 2 ? 1 : sizeof(double)) != bytes) {
+    stop("The var-cov matrix does not match its cache header.");
+  }
+  FILE* fp = std::fopen(path.c_str(), "wb");
+  if (!fp) return false;
+  bool ok = std::fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+    (bytes == 0 || std::fwrite(data, bytes, 1, fp) == 1);
+  ok = (std::fclose(fp) == 0) && ok;
+  return ok;
+}
+
+
+// Header of the cache file `path` and the size of the file, or false if it is
+// missing, truncated or not a cache file of this kind
+static bool vcv_check(const std::string& path, const int& kind, VcvHeader& hdr){
+  FILE* fp = std::fopen(path.c_str(), "rb");
+  if (!fp) return false;
+  bool ok = std::fread(&hdr, sizeof(hdr), 1, fp) == 1 && std::fseek(fp, 0, SEEK_END) == 0;
+  long file_size = ok ? std::ftell(fp) : -1;
+  std::fclose(fp);
+  return ok && std::memcmp(hdr.magic, vcv_magic, sizeof(vcv_magic)) == 0 &&
+    hdr.kind == kind && hdr.n >= 0 && file_size >= 0 &&
+    (size_t)file_size == sizeof(hdr) + vcv_data_bytes(kind, hdr.n);
+}
+
+// Read a cached var-cov matrix into a new R object: a read-through file cache,
+// which saves building the matrix from the tree but not its allocation. The
+// object is allocated while no file is open, since allocation errors do not
+// return. Returns NULL if the file is missing, truncated or of another kind,
+// so that the caller rebuilds it.
+// [[Rcpp::export]]
+SEXP vcv_read_cpp(const std::string& path, const int& kind){
+  VcvHeader hdr;
+  if (!vcv_check(path, kind, hdr)) return R_NilValue;
+  size_t bytes = vcv_data_bytes(kind, hdr.n);
+  size_t len = kind == 0 ? (size_t)hdr.n * hdr.n : (size_t)hdr.n * (hdr.n + 1) / 2;
+  SEXP out;
+  if (kind == 0) {
+    out = PROTECT(Rf_allocMatrix(REALSXP, hdr.n, hdr.n));
+  } else if (kind == 1) {
+    out = PROTECT(Rf_allocVector(REALSXP, len));
+  } else {
+    out = PROTECT(Rf_allocVector(RAWSXP, bytes));
+  }
+  void* dest = kind == 2 ? (void*)RAW(out) : (void*)REAL(out);
+  // files are replaced by renaming, never rewritten, so a file of the same
+  // name and size still holds the same values
+  VcvHeader again;
+  bool ok = false;
+  FILE* fp = std::fopen(path.c_str(), "rb");
+  if (fp) {
+    ok = std::fread(&again, sizeof(again), 1, fp) == 1 &&
+      std::memcmp(&again, &hdr, sizeof(hdr)) == 0 &&
+      (bytes == 0 || std::fread(dest, bytes, 1, fp) == 1);
+    std::fclose(fp);
+  }
+  UNPROTECT(1);
+  if (!ok) return R_NilValue;
+  return out;
+}